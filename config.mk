@@ -10,6 +10,16 @@ DOCPREFIX = ${PREFIX}/share/doc
 # remove NEED_STRLCPY from CFLAGS and
 # remove strlcpy.o from LIBS
 CFLAGS   = -DNEED_STRLCPY -Os
+# Linux: io_uring(7) event loop and out file writes, falls back to epoll(7)
+# and writev(2) at runtime on kernels before 5.19
+#CFLAGS   = -DNEED_STRLCPY -DUSE_IOURING -Os
 LDFLAGS  = -s
 LIBS     = strlcpy.o
 
+# native TLS (-e), needs OpenSSL 1.1.1 or later
+#CFLAGS   = -DNEED_STRLCPY -DUSE_TLS -Os
+#TLSLIBS  = -lssl -lcrypto
+
+# the out file writer thread
+THREADLIBS = -lpthread
+
@@ -1,25 +1,48 @@
 /* See LICENSE file for license details. */
-#include <sys/select.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#define USE_EPOLL
+#else
+#undef USE_IOURING
+#endif
+#ifdef USE_IOURING
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <sys/un.h>
 
 #include <ctype.h>
+#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
 #include <pwd.h>
 #include <signal.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 #include <unistd.h>
 
+#ifdef USE_IOURING
+#include <linux/io_uring.h>
+#endif
+#ifdef USE_TLS
+#include <arpa/inet.h>
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#endif
+
 #define READ_FD 6
 #define WRITE_FD 7
 
@@ -34,85 +57,568 @@ size_t strlcpy(char *, const char *, size_t);
 #define IRC_CHANNEL_MAX   200
 #define IRC_NICK_MAX      200
 #define IRC_MSG_MAX       512 /* quaranteed to be <= than PIPE_BUF */
+#define IRC_TAGS_MAX     8191 /* IRCv3 message tags, without the '@' */
+#define IRC_BUF_MAX     16384 /* server receive buffer size, holds at least
+                               * one line with tags (IRC_TAGS_MAX + 512) */
+#define IRC_PARAMS_MAX     15
+#define SENDQ_SIZE      65536 /* server send queue size */
+#define SENDQ_HIWAT     32768 /* stop reading "in" FIFOs above this... */
+#define SENDQ_LOWAT      8192 /* ...until the send queue drained to this */
+#define SENDQ_LINGER        5 /* seconds to wait for the queue on shutdown */
+#define TLS_BUFSIZE     32768 /* records in flight each way, in a BIO pair */
+#define TLS_SESSION_MAX  8192 /* largest session kept in "tls_session" */
+#define FLOOD_RATE        1.0 /* lines per second sent once the burst is used */
+#define FLOOD_BURST         5 /* lines that may be sent back to back */
+#define CHANQ_MAX          32 /* lines queued per channel before its "in"
+                               * FIFO is no longer read */
+#define PING_INTERVAL     120 /* seconds of server silence before we PING */
 #define PING_TIMEOUT      300
+#define CONNECT_STAGGER   250 /* ms between connects to the addresses */
+#define CONNECT_MAX        16 /* of a server, at most this many tried */
+#define CONNECT_TIMEOUT    30 /* seconds until the last one gives up */
+#define ADDR_TTL        86400 /* seconds the "addrs" file is used for, */
+#define ADDR_REFRESH       60 /* resolving again in the background when it
+                               * is older than this */
+#define RECONNECT_MIN       2 /* seconds before the first reconnect, doubled */
+#define RECONNECT_MAX     300 /* for every further one up to this (-R) */
 #define UMODE_MAX          10
 #define CMODE_MAX          50
+#define OUTFD_MAX         128 /* max. number of "out" files kept open, each
+                               * with its "out.idx" */
+#define DAY             86400 /* seconds per day, -d rolls at 00:00 UTC */
+#define IDX_LINES          64 /* "out.idx" gets an entry every IDX_LINES */
+#define IDX_SECS           10 /* lines or IDX_SECS seconds, what comes first */
+#define OUTQ_SIZE     1048576 /* bytes of lines queued for the writer thread,
+                               * a power of two */
+#define OUTIOV_MAX         64 /* lines appended by one writev(2) */
+#define OUTPEND_MAX       512 /* lines the writer holds back to batch */
+#define OUTREC_SIZE(n)     ((sizeof(Outrec) + (n) + 7) & ~(size_t)7)
+#define EV_MAX             64 /* max. number of events handled per wakeup */
+#define EV_READ             1
+#define EV_WRITE            2
+#define EV_DATA             4 /* data received for src, with io_uring */
+#define UBUF_COUNT         16 /* io_uring receive buffers, a power of two */
+#define UBUF_SIZE       16384
+#define WUR_ENTRIES        64 /* files the writer appends to per submission */
+#define UD_POLL             1 /* io_uring requests, in the top byte of */
+#define UD_RECV             2 /* user_data: UD(kind, fd, generation) */
+#define UD_CANCEL           3
+#define UD(k, fd, gen)     ((unsigned long long)(k) << 56 | \
+                            (unsigned long long)((gen) & 0xffffff) << 32 | \
+                            (unsigned int)(fd))
+#define CHANTAB_MIN        64 /* initial size of the channel hash table */
+#define NICKSET_MIN        16 /* initial size of a channel's nick set */
+#define USERTAB_MIN       256 /* initial size of the nick -> channels index */
+#define NICK_MAX           32
+#define STATS_INTERVAL     60 /* seconds between rewrites of the stats file */
+#define HIST_MAX           20 /* proc_server_cmd() time buckets: <128ns,
+                               * <256ns, ... doubling, and the rest */
+
+#define SPAN(s)            (int)(s).len, (s).p ? (s).p : "" /* for "%.*s" */
+#define CMDKEY(a, b, c, d) ((unsigned long)(a) << 24 | (unsigned long)(b) << 16 | \
+                            (unsigned long)(c) << 8 | (unsigned long)(d))
+
+enum { SRC_CONN = 1, SRC_CHANNEL }; /* first member of event sources */
+
+/* commands handled by proc_server_cmd(), indices into cmds[] */
+enum { CMD_ERROR, CMD_JOIN, CMD_KICK, CMD_MODE, CMD_NICK, CMD_NOTICE, CMD_PART,
+       CMD_PING, CMD_PONG, CMD_PRIVMSG, CMD_QUIT, CMD_TOPIC, CMD_LAST };
+
+enum { RPL_WELCOME = 1, RPL_ISUPPORT = 5, RPL_NAMREPLY = 353 };
+
+/* an address of a server to connect to, see tcpopen() */
+typedef struct Addr Addr;
+struct Addr {
+	struct sockaddr_storage sa;
+	socklen_t len;
+};
+
+/* what the background resolver needs of a Conn, which may be gone by the
+ * time it is done. one per server, whoever is last frees it. */
+enum { REFRESH_IDLE, REFRESH_BUSY, REFRESH_GONE };
+typedef struct Refresh Refresh;
+struct Refresh {
+	const char *host;           /* from argv, outlives the thread */
+	const char *service;
+	char dir[PATH_MAX];         /* the addrs file is put here */
+	int state;                  /* REFRESH_*, atomic */
+};
 
-enum { TOK_NICKSRV = 0, TOK_USER, TOK_CMD, TOK_CHAN, TOK_ARG, TOK_TEXT, TOK_LAST };
+/* the irc directory of a server. the out files of its channels are opened
+ * relative to it, and the writer may still do so after the server is gone:
+ * the last one to let go closes it. */
+typedef struct Dir Dir;
+struct Dir {
+	int fd;
+	int refs;                   /* atomic */
+};
 
+typedef struct Channel Channel;
+typedef struct Msg Msg;
 typedef struct Nick Nick;
-struct Nick {
+typedef struct User User;
+
+/* a nick we share at least one channel with */
+struct User {
         char name[IRC_NICK_MAX];
+        unsigned long hash;         /* hash of name */
+        Nick *chans;                /* channel memberships */
+        User *hnext;                /* next user in the same hash bucket */
+};
+
+/* a line written to an "in" FIFO, waiting for the flood control */
+struct Msg {
+        Msg *next;
+        size_t len;
+        char buf[];
+};
+
+/* membership of a user in a channel */
+struct Nick {
+        User *user;
         char prefix;
-	Nick *next;
+        char prefixend;             /* always '\0', so &prefix is a string */
+        Channel *chan;
+        Nick *uprev, *unext;        /* other memberships of the same user */
 };
 
-typedef struct Channel Channel;
+typedef struct Linebuf Linebuf;
+struct Linebuf {
+	char buf[IRC_BUF_MAX];
+	size_t len;            /* bytes buffered, not yet dispatched */
+	int discard;           /* skipping the tail of an overlong line */
+	unsigned long nreads;  /* read(2) calls done on this buffer */
+	unsigned long nlines;  /* lines dispatched from this buffer */
+};
+
+/* counters exported through the stats file */
+typedef struct Stats Stats;
+struct Stats {
+	time_t started;
+	unsigned long long bytesin;
+	unsigned long long linesout, bytesout; /* queued for the server */
+	unsigned long ncmd[CMD_LAST], nnumeric, nother; /* lines by command */
+	unsigned long long nprint, printbytes;  /* channel_print() */
+	unsigned long ndrop;                    /* lines dropped, -W drop */
+	unsigned long nreconnect;               /* connections lost and retried */
+	unsigned long hist[HIST_MAX];           /* time in proc_server_cmd() */
+	time_t written;                         /* stats file last written */
+};
+
+/* a server connection and all state that belongs to it. with several -s
+ * options one process drives one Conn per server. */
+typedef struct Conn Conn;
+struct Conn {
+	int srctype;           /* SRC_CONN */
+	Conn *next;
+	int running;           /* cleared by /q */
+
+	/* from the command line */
+	const char *host, *service, *uds, *key, *username, *fullname;
+	int ucspi;
+	int tls;               /* -e */
+	const char *cafile;    /* -C, default CA certificates if NULL */
+
+	char nick[NICK_MAX];   /* active nickname at runtime */
+	char _nick[NICK_MAX];  /* nickname requested by /n */
+	char ircpath[PATH_MAX];     /* irc dir for this server */
+	Dir *dir;                   /* ircpath, channel dirs are made in it */
+	char upref[UMODE_MAX];      /* user prefixes in use on this server */
+	char umodes[UMODE_MAX];     /* modes corresponding to the prefixes */
+	char cmodes[CMODE_MAX];     /* channel modes in use on this server */
+	Channel *channels;
+	Channel *channelmaster;
+	Channel **chantab;          /* channels hashed by normalized name */
+	size_t chantabsize, nchantab;
+	User **usertab;             /* users hashed by nick */
+	size_t usertabsize, nusertab;
+	time_t last_response, last_ping;
+	int fifosblocked;           /* "in" FIFOs not read, send queue full or
+	                             * not registered after a reconnect */
+	int connected;              /* else waiting to reconnect at retryat */
+	int registered;             /* got 001 on this connection */
+	int retries;                /* reconnects since the last 001 */
+	time_t retryat;
+
+	/* connect in progress, carried on by tcpstep() */
+	int connecting;
+	Addr addrs[CONNECT_MAX];    /* the addresses tried, in order */
+	int naddrs, nexta;          /* how many, the next one to try */
+	int addrcached;             /* taken from the addrs file */
+	time_t addrwhen;            /* when they were resolved */
+	struct pollfd cpfd[CONNECT_MAX]; /* attempts in flight */
+	int cidx[CONNECT_MAX];      /* and which address each is for */
+	int ncpfd;
+	int cwon;                   /* the address that answered */
+	int cerr;                   /* errno of the last failed attempt */
+	long long cnext, cend;      /* ms: next attempt due, giving up */
+	Refresh *refresh;           /* background resolver, once started */
+
+	int infd, outfd;       /* same socket unless running under UCSPI */
+	Linebuf rb;            /* received, not yet dispatched */
+	char sq[SENDQ_SIZE];   /* ring buffer of lines waiting to be sent */
+	size_t sqhead, sqlen;
+	int sqwait;            /* waiting for outfd to become writable */
+	double tokens;         /* flood control token bucket */
+	long long refilled;    /* when tokens were last refilled (ms) */
+	Channel *rrhead;       /* channels with queued lines, served */
+	Channel *rrtail;       /* round-robin */
+#ifdef USE_TLS
+	SSL_CTX *tlsctx;
+	SSL *ssl;              /* NULL: plain text */
+	BIO *tlsio;            /* our end of the BIO pair, records to and from
+	                        * the socket */
+#endif
+	Stats st;
+};
+
+/* part of a received line, not NUL-terminated. p is NULL if absent. */
+typedef struct Span Span;
+struct Span {
+	const char *p;
+	size_t len;
+};
+
+/* a line from the server, split without copying or modifying it */
+typedef struct Ircmsg Ircmsg;
+struct Ircmsg {
+	Span tags;             /* IRCv3 message tags, without the '@' */
+	Span nick, user, host; /* prefix; nick is the server name if there is
+	                        * no user */
+	Span cmd;
+	int num;               /* numeric reply, 0 for commands */
+	Span params[IRC_PARAMS_MAX]; /* the trailing one without its ':' */
+	size_t nparams;
+};
+
+typedef struct Cmd Cmd;
+struct Cmd {
+	const char *name;
+	void (*fn)(Conn *, const Ircmsg *);
+	int fromserver;        /* also handled without a nick!user prefix */
+};
+
+/* an entry of "out.idx": the line at byte off of "out" and every line after
+ * it were written at or after sec. host byte order, see iilog.c */
+typedef struct Idx Idx;
+struct Idx {
+	int64_t sec;
+	int64_t off;
+};
+
+/* an "out" file. created with its channel, but from then on only the writer
+ * thread uses it; the event loop queues its lines and finally an OUT_CLOSE,
+ * on which the writer frees it. dir and sub never change, the channel makes
+ * its "in" FIFO there too until it queues the OUT_CLOSE. */
+typedef struct Outfile Outfile;
+struct Outfile {
+	char path[PATH_MAX];        /* for messages, files are opened in dir */
+	Dir *dir;                   /* the server directory, */
+	char sub[IRC_CHANNEL_MAX];  /* and the channel's in it, "" for the
+	                             * master channel */
+	int fd;                     /* -1 if not open */
+	int idxfd;                  /* its "out.idx", -1 if that failed */
+	dev_t dev;                  /* identity of the open file, */
+	ino_t ino;                  /* to notice when it is moved away */
+	time_t checked;             /* last time path was checked */
+	off_t size;                 /* size of the open file */
+	long day;                   /* day of its last line, for -d */
+	int idxlines;               /* lines since the last "out.idx" entry */
+	time_t idxlast;             /* time of the last entry */
+	int dirty;                  /* written since the last fdatasync(2) */
+	Outfile *lruprev, *lrunext; /* open files, most recent first */
+};
+
+/* a record in the writer queue, followed by len bytes of data */
+enum { OUT_PAD, OUT_LINE, OUT_CLOSE, OUT_REOPEN, OUT_STOP };
+typedef struct Outrec Outrec;
+struct Outrec {
+	Outfile *of;                /* NULL: stdout */
+	time_t sec;                 /* clk when it was queued */
+	unsigned int len;
+	int op;
+};
+
+typedef struct Event Event;
+struct Event {
+	void *src;             /* Channel or Conn, as passed to ev_add() */
+	int flags;             /* EV_READ, EV_WRITE, EV_DATA */
+	const char *data;      /* EV_DATA: len bytes, valid until the next */
+	ssize_t len;           /* ev_wait(); len 0 at EOF, -errno on error */
+};
+
+#ifdef USE_IOURING
+typedef struct Uring Uring;
+struct Uring {
+	int fd;
+	unsigned entries;
+	unsigned *sqhead, *sqtail, *sqmask, *sqarray;
+	unsigned *cqhead, *cqtail, *cqmask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	unsigned sqnext;       /* tail including entries not yet submitted */
+};
+
+/* what an fd registered with ev_add() wants and what is in flight for it */
+typedef struct Ureg Ureg;
+struct Ureg {
+	void *src;             /* NULL: not registered */
+	int flags;             /* EV_READ, EV_WRITE */
+	int sock;              /* EV_READ by multishot receive */
+	int recv;              /* receive in flight */
+	int poll;              /* poll mask in flight */
+	unsigned gen, pgen;    /* stale completions are told by these */
+};
+#endif
+
 struct Channel {
+	int srctype;                /* SRC_CHANNEL */
+	Conn *cn;                   /* server this channel belongs to */
 	int fdin;
+	Outfile *out;               /* "out" file, owned by the writer */
+	unsigned long hash;         /* hash of name */
 	char name[IRC_CHANNEL_MAX]; /* channel name (normalized) */
-	char inpath[PATH_MAX];      /* input path */
-        char outpath[PATH_MAX];     /* output path */
-        Nick *nicks;
+        Nick **nicks;               /* open addressing set of nicks */
+        size_t nickssize, nnicks;
 	Channel *next;
+	Channel *hnext;             /* next channel in the same hash bucket */
+	Msg *mq, *mqtail;           /* lines waiting to be sent */
+	size_t nmq;
+	int inblocked;              /* "in" not read, too many lines queued */
+	Channel *rrnext;            /* next channel with lines to send */
 };
 
-static void      cap_parse(char *);
-static Channel * channel_add(const char *);
-static Channel * channel_find(const char *);
-static Channel * channel_join(const char *);
+static void      addr_close(Conn *, int);
+static void      addr_start(Conn *, const Addr *, int, time_t);
+static int       addr_step(Conn *, int);
+static int       addr_load(const char *, const char *, Addr *, int, time_t *);
+static void      addr_refresh(Conn *);
+static void      addr_refresh_free(Conn *);
+static void *    addr_refresh_run(void *);
+static int       addr_resolve(const char *, const char *, Addr *, int);
+static void      addr_save(const char *, const char *, const Addr *, int, time_t);
+static void      cap_parse(Conn *, const Ircmsg *);
+static void      cmd_error(Conn *, const Ircmsg *);
+static const Cmd *cmd_find(Span);
+static void      cmd_isupport(Conn *, const Ircmsg *);
+static void      cmd_join(Conn *, const Ircmsg *);
+static void      cmd_kick(Conn *, const Ircmsg *);
+static void      cmd_mode(Conn *, const Ircmsg *);
+static void      cmd_names(Conn *, const Ircmsg *);
+static void      cmd_nick(Conn *, const Ircmsg *);
+static void      cmd_notice(Conn *, const Ircmsg *);
+static void      cmd_part(Conn *, const Ircmsg *);
+static void      cmd_ping(Conn *, const Ircmsg *);
+static void      cmd_pong(Conn *, const Ircmsg *);
+static void      cmd_privmsg(Conn *, const Ircmsg *);
+static void      cmd_quit(Conn *, const Ircmsg *);
+static void      cmd_topic(Conn *, const Ircmsg *);
+static void      cmd_welcome(Conn *, const Ircmsg *);
+static Channel * channel_add(Conn *, const char *);
+static Channel * channel_find(Conn *, const char *);
+static Channel * channel_join(Conn *, const char *);
 static void      channel_leave(Channel *);
-static Channel * channel_new(const char *);
-static void      channel_normalize_name(char *);
+static Channel * channel_new(Conn *, const char *);
+static void      channel_normalize_name(const Conn *, char *);
 static void      channel_normalize_path(char *);
 static int       channel_open(Channel *);
 static void      channel_print(Channel *, const char *);
 static int       channel_reopen(Channel *);
 static void      channel_rm(Channel *);
+static void      chantab_add(Channel *);
+static void      chantab_rm(Channel *);
+static void      clock_update(void);
 static void      create_dirtree(const char *);
+static void      conn_close(Conn *);
+static int       conn_connect(Conn *);
+static void      conn_disconnect(Conn *);
+static void      conn_flush(Conn *);
+static void      conn_free(Conn *, int);
+static void      conn_lost(Conn *, int);
+static void      conn_retry(Conn *);
+static int       conn_step(Conn *, int);
+static void      conn_up(Conn *, int);
+static void      conn_werror(Conn *);
+static void      conn_init(Conn *);
+static Conn *    conn_new(const Conn *);
+static void      conn_write(Conn *, const char *);
+static size_t    conn_writev(Conn *);
 static void      create_filepath(char *, size_t, const char *, const char *, const char *);
-static void      ewritestr(int, const char *);
-static void      handle_channels_input(int, Channel *);
-static void      handle_server_output(int, int);
-static void      loginkey(int, const char *);
-static void      loginuser(int, const char *, const char *, const char *);
+static DIR *     dir_open(int);
+static void      dir_release(Dir *);
+static int       ev_add(int, void *, int);
+#ifdef USE_EPOLL
+static int       ev_ctl(int, int, void *, int);
+#endif
+static void      ev_del(int, void *);
+static void      ev_init(void);
+static int       ev_mod(int, void *, int);
+static int       ev_wait(int);
+static void      fifos_block(Conn *, int);
+static void      fifo_block(Channel *, int);
+static void      handle_channels_input(Channel *);
+static void      handle_server_output(Conn *);
+static int       irc_parse(Ircmsg *, const char *, size_t);
+static Span      irc_param(const Ircmsg *, size_t);
+static void      irc_params_join(const Ircmsg *, size_t, char *, size_t);
+static Span      irc_userhost(const Ircmsg *);
+static void      loginkey(Conn *, const char *);
+static void      loginuser(Conn *);
 #define name_add(c, n) name_add3((c), (n), '\0')
-static void      name_add3(const char *, const char *, const char);
+static void      name_add3(Channel *, const char *, const char);
+static void      name_clear(Channel *);
 static Nick *    name_find(Channel *, const char *);
-static void      name_menick(const char *, const char *);
-static void      name_mode(const char *, char *, char *);
-static void      name_nick(const char *, const char *);
-static void      name_quit(const char *, const char *, const char *);
-static int       name_rm(const char *, const char *);
+static void      name_free(Nick *);
+static size_t    name_slot(const Channel *, const char *, unsigned long);
+static void      name_menick(Conn *, const char *, const char *);
+static void      name_mode(Conn *, const Ircmsg *);
+static void      name_nick(Conn *, const char *, const char *);
+static void      name_quit(Conn *, const char *);
+static int       name_rm(Conn *, const char *, const char *);
 static int       name_rm3(Channel *, const char *, char *);
-static void      parse_cmodes(char *);
-static void      parse_prefix(char *);
-static void      proc_channels_input(int, Channel *, char *);
-static void      proc_channels_privmsg(int, Channel *, char *);
-static void      proc_names(const char *, char *);
-static void      proc_server_cmd(int, char *);
+static void      out_close(Outfile *);
+static void      out_flush(void);
+static void      out_idxadd(Outfile *, time_t);
+static void      out_line(Outrec *);
+static void      out_writev(int, struct iovec *, int, size_t);
+static const char *out_relpath(const Outfile *, const char *, char *, size_t);
+static int       out_open(Outfile *, time_t);
+static void      out_prune(int);
+static void      out_roll(Outfile *);
+static void      out_sync(void);
+static void      outq_commit(Outfile *, int, size_t);
+static void      outq_ctl(Outfile *, int);
+static void      outq_publish(void);
+static char *    outq_reserve(size_t, int);
+static void      parse_cmodes(Conn *, const char *);
+static void      parse_prefix(Conn *, const char *);
+static void      proc_channels_input(Conn *, Channel *, char *);
+static void      privmsg_print(Conn *, const Ircmsg *, int);
+static void      proc_channels_privmsg(Conn *, Channel *, char *);
+static void      proc_names(Conn *, Span, Span);
+static void      proc_server_cmd(Conn *, const char *);
 static int       ptr_split(const char *, const char *, const char *, const char *);
 static int       read_line(int, char *, size_t);
-static void      run(int, int, const char *);
+static unsigned long strhash(const char *);
+static void      run(void);
+static void      sched_drop(Conn *, Channel *);
+static void      sched_push(Conn *, Channel *, const char *);
+static int       sched_run(Conn *);
+static long long uptime_ms(void);
+static long long uptime_ns(void);
+static void      server_input(Conn *, size_t);
+static void      server_line(Conn *, const char *);
+static void      server_lost(Conn *, int);
+static void      server_recv(Conn *, const char *, ssize_t);
+static void      server_print(Conn *, const Ircmsg *);
 static void      setup(void);
 static void      sighandler(int);
-static int       tcpopen(const char *, const char *);
-static void      tokenize(char **, char *);
+static int       span_eq(Span, const char *);
+static char *    span_str(Span, char *, size_t);
+static int       stats_write(Conn *);
+static int       tcpopen(Conn *);
+static int       tcpstep(Conn *, int);
+static const char *timestamp(size_t *);
+#ifdef USE_IOURING
+static void      ubuf_recycle(void);
+static int       uev_add(int, void *, int);
+static void      uev_arm(int);
+static void      uev_del(int);
+static int       uev_init(void);
+static int       uev_mod(int, void *, int);
+static void      uev_push(void *, int, const char *, ssize_t);
+static int       uev_wait(int);
+static int       uring_enter(Uring *, unsigned, int);
+static int       uring_init(Uring *, unsigned);
+static struct io_uring_sqe *uring_sqe(Uring *);
+#endif
+#ifdef USE_TLS
+static size_t    tls_flush(Conn *);
+static int       tls_input(Conn *);
+static int       tls_newsession(SSL *, SSL_SESSION *);
+static void      tls_read(Conn *);
+static void      tls_recv(Conn *, const char *, ssize_t);
+static void      tls_start(Conn *);
+static const char *tls_strerror(Conn *);
+#endif
 static int       udsopen(const char *);
 static void      usage(void);
+static User *    user_find(Conn *, const char *);
+static User *    user_get(Conn *, const char *);
+static void      user_rm(Conn *, User *);
+static void *    writer_run(void *);
+static void      writer_start(void);
+static void      writer_stop(void);
 
 static int      isrunning = 1;
-static time_t   last_response = 0;
-static Channel *channels = NULL;
-static Channel *channelmaster = NULL;
-static char     nick[32];          /* active nickname at runtime */
-static char     _nick[32];         /* nickname at startup */
-static char     ircpath[PATH_MAX]; /* irc dir (-i) */
+static int      exitstatus = 0;
+static volatile sig_atomic_t reopenout = 0; /* SIGHUP: reopen "out" files */
+static Conn    *conns = NULL;      /* server connections */
+static char     prefix[PATH_MAX];  /* irc dir (-i) */
+static Outfile *outlru = NULL;     /* open "out" files, writer thread only */
+static Outfile *outlrutail = NULL; /* least recently written to */
+static int      noutfds = 0;
+static unsigned long outrolls = 0; /* "out" segments rolled */
+static unsigned long outsyncs = 0; /* fdatasync(2)s of out files */
+static int      noutdirty = 0;     /* out files not synced, writer only */
+static struct { int fd; struct iovec iov; } outpend[OUTPEND_MAX];
+static int      noutpend = 0;      /* lines held back by the writer */
 static char     msg[IRC_MSG_MAX];  /* message buf used for communication */
 static int      trackprefix = 1;   /* flag to track user prefixes */
-static char     upref[UMODE_MAX];  /* user prefixes in use on this server */
-static char     umodes[UMODE_MAX]; /* modes corresponding to the prefixes */
-static char     cmodes[CMODE_MAX]; /* channel modes in use on this server */
+static double   floodrate = FLOOD_RATE;  /* -r, 0 disables flood control */
+static int      floodburst = FLOOD_BURST; /* -b */
+static off_t    outmax = 0;        /* -l: roll "out" at this size, 0 never */
+static int      outdaily = 0;      /* -d: roll "out" at the start of a day */
+static int      outkeep = 0;       /* -N: old segments kept, 0 keeps all */
+static int      reconnmax = RECONNECT_MAX; /* -R, 0: exit instead */
+static int      outdrop = 0;       /* -W drop: drop lines the writer cannot
+                                    * take instead of waiting for it */
+static int      outsync = -1;      /* -S: ms between fdatasync(2)s of the
+                                    * out files, 0 after every batch, -1
+                                    * never */
+static char    *outq;              /* lines for the writer thread */
+static size_t   outqnext = 0;      /* end of the records queued, */
+static size_t   outqhead = 0;      /* published to the writer, */
+static size_t   outqtail = 0;      /* and done by the writer */
+static int      outqsleep = 0;     /* writer waits on outqwake */
+static int      outqwake[2];
+static pthread_t writer;
+static struct timespec clk;        /* sampled once per event loop iteration */
+static int      tsprec = 0;        /* -T: digits after the second, 0, 3 or 6 */
+static const Cmd cmds[] = {
+	[CMD_ERROR]   = { "ERROR",   cmd_error,   0 },
+	[CMD_JOIN]    = { "JOIN",    cmd_join,    0 },
+	[CMD_KICK]    = { "KICK",    cmd_kick,    1 },
+	[CMD_MODE]    = { "MODE",    cmd_mode,    1 },
+	[CMD_NICK]    = { "NICK",    cmd_nick,    0 },
+	[CMD_NOTICE]  = { "NOTICE",  cmd_notice,  0 },
+	[CMD_PART]    = { "PART",    cmd_part,    0 },
+	[CMD_PING]    = { "PING",    cmd_ping,    1 },
+	[CMD_PONG]    = { "PONG",    cmd_pong,    1 },
+	[CMD_PRIVMSG] = { "PRIVMSG", cmd_privmsg, 0 },
+	[CMD_QUIT]    = { "QUIT",    cmd_quit,    0 },
+	[CMD_TOPIC]   = { "TOPIC",   cmd_topic,   1 },
+};
+static Event    evready[EV_MAX];   /* event sources ready after ev_wait() */
+static int      nevready = 0;
+#ifdef USE_EPOLL
+static int      epfd = -1;
+#ifdef USE_IOURING
+static Uring    ur = { .fd = -1 }; /* event loop, epoll is used if -1 */
+static Ureg    *uregs = NULL;      /* indexed by fd */
+static size_t   nuregs = 0;
+static struct io_uring_buf_ring *ubufring; /* receive buffers */
+static char    *ubufs;
+static unsigned short ubuftail = 0;
+static int      ubufdone[UBUF_COUNT]; /* handed out by the last ev_wait() */
+static int      nubufdone = 0;
+static Uring    wur = { .fd = -1 }; /* writer thread */
+#endif
+#else
+static struct pollfd *evfds = NULL; /* registered fds for poll(2) */
+static void   **evsrcs = NULL;      /* and their event sources */
+static size_t   nevfds = 0, evfdscap = 0;
+#endif
 
 
 static void
@@ -120,637 +626,3202 @@ usage(void)
 {
         fprintf(stderr, "usage: %s <-s host> [-t] [-P] [-i <irc dir>] "
                 "[-p <port>] [-U <sockname>] [-n <nick>] [-k <password>] "
-                "[-u <username>] [-f <fullname>]\n",
+                "[-u <username>] [-f <fullname>] [-r <rate>] [-b <burst>] "
+                "[-T s|ms|us] [-l <size>] [-d] [-N <segments>] "
+                "[-W block|drop] [-S none|batch|<ms>] [-e] [-C <cafile>] "
+                "[-R <seconds>] "
+                "[-s host [server options] ...]\n",
                 argv0);
 	exit(1);
 }
 
-static void
-ewritestr(int fd, const char *s)
+/* a new connection with the command line options of tmpl */
+static Conn *
+conn_new(const Conn *tmpl)
 {
-	size_t len, off = 0;
-	int w = -1;
+	Conn *cn;
 
-	len = strlen(s);
-	for (off = 0; off < len; off += w) {
-		if ((w = write(fd, s + off, len - off)) == -1)
-			break;
-		off += w;
-	}
-	if (w == -1) {
-		fprintf(stderr, "%s: write: %s\n", argv0, strerror(errno));
+	if (!(cn = calloc(1, sizeof(Conn)))) {
+		fprintf(stderr, "%s: calloc: %s\n", argv0, strerror(errno));
 		exit(1);
 	}
+	cn->srctype = SRC_CONN;
+	cn->host = tmpl->host;
+	cn->service = tmpl->service;
+	cn->uds = tmpl->uds;
+	cn->key = tmpl->key;
+	cn->username = tmpl->username;
+	cn->fullname = tmpl->fullname;
+	cn->ucspi = tmpl->ucspi;
+	cn->tls = tmpl->tls;
+	cn->cafile = tmpl->cafile;
+	strlcpy(cn->nick, tmpl->nick, sizeof(cn->nick));
+	return cn;
 }
 
-/* creates directories bottom-up, if necessary */
+/* set up the server directory and connect */
 static void
-create_dirtree(const char *dir)
+conn_init(Conn *cn)
 {
-	char tmp[PATH_MAX], *p;
-	struct stat st;
-	size_t len;
+	int r;
 
-	strlcpy(tmp, dir, sizeof(tmp));
-	len = strlen(tmp);
-	if (len > 0 && tmp[len - 1] == '/')
-		tmp[len - 1] = '\0';
+	cn->running = 1;
+	cn->st.started = cn->st.written = clk.tv_sec;
 
-	if ((stat(tmp, &st) != -1) && S_ISDIR(st.st_mode))
-		return; /* dir exists */
+	/* default values for prefixes and channel modes. these need
+	 * to be tracked regardless of whether we're keeping track of
+	 * people's modes, because we still need to know what the prefix
+	 * chars so we can skip them. */
+	parse_prefix(cn, "(qaohv)~&@%+");
+	parse_cmodes(cn, "beI,k,l,imMnOPQRstVz");
 
-	for (p = tmp + 1; *p; p++) {
-		if (*p != '/')
-			continue;
-		*p = '\0';
-		mkdir(tmp, S_IRWXU);
-		*p = '/';
+	r = snprintf(cn->ircpath, sizeof(cn->ircpath), "%s/%s", prefix, cn->host);
+	if (r < 0 || (size_t)r >= sizeof(cn->ircpath)) {
+		fprintf(stderr, "%s: path to irc directory too long\n", argv0);
+		exit(1);
 	}
-	mkdir(tmp, S_IRWXU);
-}
-
-static void
-channel_normalize_path(char *s)
-{
-	for (; *s; s++) {
-		if (isalpha(*s))
-			*s = tolower(*s);
-		else if (!isdigit(*s) && !strchr(".#&+!-", *s))
-			*s = '_';
+	create_dirtree(cn->ircpath);
+	if (!(cn->dir = malloc(sizeof(Dir)))) {
+		fprintf(stderr, "%s: malloc: %s\n", argv0, strerror(errno));
+		exit(1);
 	}
-}
-
-static void
-channel_normalize_name(char *s)
-{
-	char *p;
-
-	/* corner case for channelmaster */
-	if (*s == '\0')
-		return;
-
-	/* advance over the channel prefix char (&#) and any possible prefix
-	 * characters if we have received a message for opers
-	 * (e.g. NOTICE @#chan :hey ops) */
-        while (*s == '&' || *s == '#' || strchr(upref, s[0]) != NULL)
-		s++;
-	for (p = s; *s; s++) {
-		/* sanitise the channel name of invalid chars and downcase
-		 * alphanumerics */
-		if (!strchr(" ,&#\x07", *s)) {
-			*p = isalpha(*s) ? tolower(*s) : *s;
-			p++;
-		}
+	cn->dir->refs = 1;
+	if ((cn->dir->fd = open(cn->ircpath, O_RDONLY | O_DIRECTORY)) == -1) {
+		fprintf(stderr, "%s: %s: %s\n", argv0, cn->ircpath, strerror(errno));
+		exit(1);
 	}
-	*p = '\0';
+
+	cn->channelmaster = channel_add(cn, ""); /* master channel */
+	/* nothing else runs yet: wait for the connect right here */
+	for (r = conn_connect(cn); r > 0; r = conn_step(cn, r))
+		;
+	if (r == -1)
+		exit(1);
 }
 
-static void
-create_filepath(char *filepath, size_t len, const char *path,
-	const char *channel, const char *suffix)
+/* open the connection to the server and log in. 0 once connected, -1 if
+ * it failed (the reason is printed), else the ms until conn_step() should
+ * carry the TCP connect on. */
+static int
+conn_connect(Conn *cn)
 {
-	int r;
+	int fd;
 
-	if (channel[0]) {
-		r = snprintf(filepath, len, "%s/%s", path, channel);
-		if (r < 0 || (size_t)r >= len)
-			goto error;
-		create_dirtree(filepath);
-		r = snprintf(filepath, len, "%s/%s/%s", path, channel, suffix);
-		if (r < 0 || (size_t)r >= len)
-			goto error;
-	} else {
-		r = snprintf(filepath, len, "%s/%s", path, suffix);
-		if (r < 0 || (size_t)r >= len)
-			goto error;
+	if (cn->uds) {
+		if ((fd = udsopen(cn->uds)) == -1)
+			return -1;
+		conn_up(cn, fd);
+		return 0;
 	}
-	return;
-
-error:
-	fprintf(stderr, "%s: path to irc directory too long\n", argv0);
-	exit(1);
+	if (cn->ucspi) {
+		conn_up(cn, -1);
+		return 0;
+	}
+	if (tcpopen(cn) == -1)
+		return -1;
+	cn->connecting = 1;
+	return conn_step(cn, 0);
 }
 
+/* carry a TCP connect on, waiting at most timeout ms for an attempt to
+ * answer; returns like conn_connect(). the event loop calls it with 0
+ * whenever it wakes up, the sockets tried are registered with it. */
 static int
-channel_open(Channel *c)
+conn_step(Conn *cn, int timeout)
 {
+	long long t;
 	int fd;
-	struct stat st;
 
-	/* make "in" fifo if it doesn't exist already. */
-	if (lstat(c->inpath, &st) != -1) {
-		if (!(st.st_mode & S_IFIFO))
-			return -1;
-	} else if (mkfifo(c->inpath, S_IRWXU)) {
-		return -1;
+	if ((fd = tcpstep(cn, timeout)) == -2) {
+		t = (cn->nexta < cn->naddrs && cn->cnext < cn->cend ?
+		     cn->cnext : cn->cend) - uptime_ms();
+		return t > 0 ? (int)t : 1;
 	}
-	c->fdin = -1;
-	fd = open(c->inpath, O_RDONLY | O_NONBLOCK, 0);
+	cn->connecting = 0;
 	if (fd == -1)
 		return -1;
-	c->fdin = fd;
-
+	conn_up(cn, fd);
 	return 0;
 }
 
-static int
-channel_reopen(Channel *c)
+/* connected on fd, or the UCSPI descriptors if -1: watch it and log in */
+static void
+conn_up(Conn *cn, int fd)
 {
-	if (c->fdin > 2) {
-		close(c->fdin);
-		c->fdin = -1;
+	int flags;
+
+	if (fd == -1) {
+		cn->infd = READ_FD;
+		cn->outfd = WRITE_FD;
+	} else {
+		cn->infd = cn->outfd = fd;
 	}
-	return channel_open(c);
+	if ((flags = fcntl(cn->outfd, F_GETFL)) == -1 ||
+	    fcntl(cn->outfd, F_SETFL, flags | O_NONBLOCK) == -1) {
+		fprintf(stderr, "%s: fcntl: %s\n", argv0, strerror(errno));
+		exit(1);
+	}
+	if (ev_add(cn->infd, cn, EV_READ) == -1) {
+		fprintf(stderr, "%s: cannot watch server connection: %s\n",
+		        argv0, strerror(errno));
+		exit(1);
+	}
+#ifdef USE_TLS
+	if (cn->tls)
+		tls_start(cn);
+#endif
+	cn->connected = 1;
+	cn->tokens = floodburst;
+	cn->refilled = uptime_ms();
+	cn->last_response = clk.tv_sec;
+	if (cn->key)
+		loginkey(cn, cn->key);
+	loginuser(cn);
 }
 
-static Channel *
-channel_new(const char *name)
+/* close the connection but keep the channels, their FIFOs and out files
+ * for the next one. writers to the "in" FIFOs block until it is
+ * registered. */
+static void
+conn_disconnect(Conn *cn)
 {
 	Channel *c;
-	char channelpath[PATH_MAX];
-
-	strlcpy(channelpath, name, sizeof(channelpath));
-	channel_normalize_path(channelpath);
 
-	if (!(c = calloc(1, sizeof(Channel)))) {
-		fprintf(stderr, "%s: calloc: %s\n", argv0, strerror(errno));
-		exit(1);
+	ev_del(cn->infd, cn);
+	if (cn->outfd != cn->infd)
+		ev_del(cn->outfd, cn);
+	close(cn->infd);
+	if (cn->outfd != cn->infd)
+		close(cn->outfd);
+	cn->infd = cn->outfd = -1;
+#ifdef USE_TLS
+	if (cn->ssl) {
+		SSL_free(cn->ssl);
+		BIO_free(cn->tlsio);
+		SSL_CTX_free(cn->tlsctx);
+		cn->ssl = NULL;
 	}
-	c->next = NULL;
-	strlcpy(c->name, name, sizeof(c->name));
-	channel_normalize_name(c->name);
-
-	create_filepath(c->inpath, sizeof(c->inpath), ircpath,
-	                channelpath, "in");
-	create_filepath(c->outpath, sizeof(c->outpath), ircpath,
-	                channelpath, "out");
-	return c;
+#endif
+	cn->connected = cn->registered = 0;
+	cn->rb.len = cn->rb.discard = 0;
+	cn->sqhead = cn->sqlen = 0;
+	cn->sqwait = 0;
+	/* the names are sent again on JOIN */
+	for (c = cn->channels; c; c = c->next)
+		name_clear(c);
+	if (!cn->fifosblocked)
+		fifos_block(cn, 1);
 }
 
-static Channel *
-channel_find(const char *name)
+/* wait before connecting again: twice as long as the last time, up to -R
+ * seconds, less a random part so that clients of a server that went away
+ * do not all come back at once. */
+static void
+conn_retry(Conn *cn)
 {
 	Channel *c;
-	char chan[IRC_CHANNEL_MAX];
+	int delay;
+
+	delay = RECONNECT_MIN << (cn->retries < 16 ? cn->retries : 16);
+	if (delay > reconnmax || delay <= 0)
+		delay = reconnmax;
+	delay -= rand() % (delay / 2 + 1);
+	cn->retries++;
+	cn->st.nreconnect++;
+	cn->retryat = clk.tv_sec + delay;
+	snprintf(msg, sizeof(msg), "-!- ii: reconnecting to %s in %d s",
+	         cn->host, delay);
+	for (c = cn->channels; c; c = c->next)
+		channel_print(c, msg);
+}
 
-	strlcpy(chan, name, sizeof(chan));
-	channel_normalize_name(chan);
-	for (c = channels; c; c = c->next) {
-		if (!strcmp(chan, c->name))
-			return c; /* already handled */
+/* the connection failed: reconnect unless -R 0 or under UCSPI, where
+ * there is nothing to reconnect to. else exit with status once no server
+ * is left. */
+static void
+conn_lost(Conn *cn, int status)
+{
+	if (!reconnmax || cn->ucspi) {
+		exitstatus = status;
+		conn_free(cn, 0);
+		return;
 	}
-	return NULL;
+	conn_disconnect(cn);
+	conn_retry(cn);
 }
 
-static Channel *
-channel_add(const char *name)
+/* tear down a connection. on shutdown (leave != 0) queued lines still get a
+ * chance to go out and the "in" FIFOs are removed. */
+static void
+conn_free(Conn *cn, int leave)
 {
-	Channel *c;
-
-	c = channel_new(name);
-	if (channel_open(c) == -1) {
-		fprintf(stderr, "%s: cannot create channel: %s: %s\n",
-		         argv0, name, strerror(errno));
-		free(c);
-		return NULL;
+	Conn **pp;
+
+	if (leave && cn->connected)
+		conn_close(cn);
+	while (cn->channels) {
+		if (leave)
+			channel_leave(cn->channels);
+		else
+			channel_rm(cn->channels);
 	}
-	if (!channels) {
-		channels = c;
-	} else {
-		c->next = channels;
-		channels = c;
-        }
-        c->nicks = NULL;
-	return c;
+	if (cn->connected)
+		conn_disconnect(cn);
+	if (cn->connecting)
+		addr_close(cn, -1);
+	addr_refresh_free(cn);
+
+	for (pp = &conns; *pp; pp = &(*pp)->next) {
+		if (*pp == cn) {
+			*pp = cn->next;
+			break;
+		}
+	}
+	dir_release(cn->dir);
+	free(cn->chantab);
+	free(cn->usertab);
+	free(cn);
 }
 
-static Channel *
-channel_join(const char *name)
+/* queue a line for the server. it is sent by conn_flush(), which run() calls
+ * once per event loop iteration so lines queued together go out together. */
+static void
+conn_write(Conn *cn, const char *s)
 {
-	Channel *c;
+	size_t len, tail, n;
 
-	if (!(c = channel_find(name)))
-		c = channel_add(name);
-	return c;
+	len = strlen(s);
+	if (len > SENDQ_SIZE - cn->sqlen) {
+		/* reading from the FIFOs stops long before this */
+		fprintf(stderr, "%s: send queue full, dropping message\n", argv0);
+		return;
+	}
+	tail = (cn->sqhead + cn->sqlen) % SENDQ_SIZE;
+	n = SENDQ_SIZE - tail < len ? SENDQ_SIZE - tail : len;
+	memcpy(cn->sq + tail, s, n);
+	memcpy(cn->sq, s + n, len - n);
+	cn->sqlen += len;
+	cn->st.linesout++;
+	cn->st.bytesout += len;
+
+	if (!cn->fifosblocked && cn->sqlen >= SENDQ_HIWAT)
+		fifos_block(cn, 1);
 }
 
-static void
-channel_rm(Channel *c)
+/* write out as much of the send queue as the socket takes without blocking.
+ * the ring buffer wraps at most once, so one writev(2) covers it. returns
+ * the bytes left over. */
+static size_t
+conn_writev(Conn *cn)
 {
-        Channel *p;
-        Nick *n, *nn;
+	struct iovec iov[2];
+	size_t n;
+	ssize_t w;
+	int iovcnt;
+
+	while (cn->sqlen > 0) {
+		n = SENDQ_SIZE - cn->sqhead;
+		iov[0].iov_base = cn->sq + cn->sqhead;
+		iov[0].iov_len = n < cn->sqlen ? n : cn->sqlen;
+		iov[1].iov_base = cn->sq;
+		iov[1].iov_len = cn->sqlen - iov[0].iov_len;
+		iovcnt = iov[1].iov_len ? 2 : 1;
+
+		if ((w = writev(cn->outfd, iov, iovcnt)) == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			conn_werror(cn);
+			cn->sqlen = 0;
+			break;
+		}
+		cn->sqhead = (cn->sqhead + w) % SENDQ_SIZE;
+		cn->sqlen -= w;
+	}
+	if (cn->sqlen == 0)
+		cn->sqhead = 0;
+	return cn->sqlen;
+}
 
-	if (channels == c) {
-		channels = channels->next;
-	} else {
-		for (p = channels; p && p->next != c; p = p->next)
-			;
-		if (p && p->next == c)
-			p->next = c->next;
-        }
+/* writing to the server failed. the connection is shut down so that the
+ * read side sees the end of it and takes the usual way out, conn_lost()
+ * cannot be called here. a UCSPI pipe cannot be shut down. */
+static void
+conn_werror(Conn *cn)
+{
+	fprintf(stderr, "%s: %s: write: %s\n", argv0, cn->host, strerror(errno));
+	if (shutdown(cn->outfd, SHUT_RDWR) == -1)
+		exit(1);
+}
 
-        for (n = c->nicks; n; n = nn) {
-                nn = n->next;
-                free(n);
-        }
+/* send what the socket takes, in plain text or through TLS */
+static void
+conn_flush(Conn *cn)
+{
+	size_t left;
 
-        free(c);
+#ifdef USE_TLS
+	if (cn->ssl)
+		left = tls_flush(cn);
+	else
+#endif
+	left = conn_writev(cn);
+
+	/* only ask for writability while there is something left over */
+	if (!cn->sqwait != !left) {
+		cn->sqwait = left > 0;
+		if (cn->infd == cn->outfd)
+			ev_mod(cn->outfd, cn, EV_READ | (cn->sqwait ? EV_WRITE : 0));
+		else if (cn->sqwait)
+			ev_add(cn->outfd, cn, EV_WRITE);
+		else
+			ev_del(cn->outfd, NULL);
+	}
+	if (cn->fifosblocked && cn->registered && cn->sqlen <= SENDQ_LOWAT)
+		fifos_block(cn, 0);
 }
 
+/* send whatever is still queued on shutdown, e.g. the QUIT line, but give up
+ * after SENDQ_LINGER seconds if the server doesn't read. */
 static void
-channel_leave(Channel *c)
+conn_close(Conn *cn)
 {
-	if (c->fdin > 2) {
-		close(c->fdin);
-		c->fdin = -1;
+	struct pollfd pfd;
+	time_t end = time(NULL) + SENDQ_LINGER;
+
+	pfd.fd = cn->outfd;
+	pfd.events = POLLOUT;
+	conn_flush(cn);
+#ifdef USE_TLS
+	/* close_notify, after the lines still queued */
+	if (cn->ssl && !cn->sqlen && SSL_is_init_finished(cn->ssl)) {
+		SSL_shutdown(cn->ssl);
+		conn_flush(cn);
+	}
+#endif
+	while (cn->sqwait && time(NULL) < end) {
+		if (poll(&pfd, 1, 1000) == -1 && errno != EINTR)
+			break;
+		conn_flush(cn);
 	}
-	/* remove "in" file on leaving the channel */
-	unlink(c->inpath);
-	channel_rm(c);
 }
 
+/* backpressure: while the send queue is above its high-water mark, stop
+ * watching the "in" FIFOs so writers block on the pipe instead of ii on the
+ * socket. */
 static void
-loginkey(int ircfd, const char *key)
+fifos_block(Conn *cn, int block)
 {
-	snprintf(msg, sizeof(msg), "PASS %s\r\n", key);
-	ewritestr(ircfd, msg);
+	Channel *c;
+
+	cn->fifosblocked = block;
+	for (c = cn->channels; c; c = c->next) {
+		if (c->fdin < 0 || c->inblocked)
+			continue;
+		if (block)
+			ev_del(c->fdin, NULL);
+		else
+			ev_add(c->fdin, c, EV_READ);
+	}
 }
 
+/* stop or resume reading a single "in" FIFO whose lines pile up in the
+ * flood control queue. */
 static void
-loginuser(int ircfd, const char *host, const char* username, const char *fullname)
+fifo_block(Channel *c, int block)
 {
-	snprintf(msg, sizeof(msg), "NICK %s\r\nUSER %s localhost %s :%s\r\n",
-	         nick, username, host, fullname);
-	puts(msg);
-	ewritestr(ircfd, msg);
+	c->inblocked = block;
+	if (c->fdin < 0 || c->cn->fifosblocked)
+		return;
+	if (block)
+		ev_del(c->fdin, NULL);
+	else
+		ev_add(c->fdin, c, EV_READ);
 }
 
+/* sample the wall clock for the timestamps and timeouts of this loop
+ * iteration. the coarse clock is enough for whole seconds and does not
+ * need to read the clock source. */
 static void
-name_add3(const char *chan, const char *name, const char modes) {
-        Channel *c;
-        Nick *n;
-        const char *p;
-
-        if(!(c = channel_find(chan)))
-                return;
-
-        p = name;
-        if (strchr(upref, p[0]) != NULL) {
-                name++;
-        }
+clock_update(void)
+{
+#ifdef CLOCK_REALTIME_COARSE
+	if (!tsprec) {
+		clock_gettime(CLOCK_REALTIME_COARSE, &clk);
+		return;
+	}
+#endif
+	clock_gettime(CLOCK_REALTIME, &clk);
+}
 
-        
-        for(n = c->nicks; n; n = n->next) {
-		if(!strcmp(name, n->name)) {
-			/* name already exists in the channel, but twiddle prefix
-			 * characters in case they've changed without us knowing.
-			 * this also means that /NAMES can be used to reset nick
-			 * state if we get confused. */
-			if (trackprefix && p != name) {
-				n->prefix = *p;
-			}
-			return;
+/* "<seconds>[.<fraction>] " for clk, the prefix of every line in the out
+ * files and on stdout. the seconds are only formatted when they change. */
+static const char *
+timestamp(size_t *len)
+{
+	static char buf[32];
+	static time_t sec = -1;
+	static size_t seclen;
+	long frac;
+	int i;
+
+	if (clk.tv_sec != sec) {
+		sec = clk.tv_sec;
+		seclen = snprintf(buf, sizeof(buf), "%lu", (unsigned long)sec);
+	}
+	*len = seclen;
+	if (tsprec) {
+		frac = clk.tv_nsec / (tsprec == 3 ? 1000000 : 1000);
+		buf[(*len)++] = '.';
+		for (i = tsprec; i > 0; i--) {
+			buf[*len + i - 1] = '0' + frac % 10;
+			frac /= 10;
 		}
+		*len += tsprec;
 	}
+	buf[(*len)++] = ' ';
+	return buf;
+}
 
-        if (!(n = calloc(1, sizeof(Nick)))) {
-		fprintf(stderr, "%s: calloc: %s\n", argv0, strerror(errno));
-		exit(1);
-	}
+static long long
+uptime_ms(void)
+{
+	struct timespec ts;
 
-        if (trackprefix && p != name) {
-                /* special people get prefix chars */
-                n->prefix = *p;
-        } else {
-                n->prefix = modes;
-        }
-        
-        strlcpy(n->name, name, sizeof(n->name));
-	n->next = c->nicks;
-	c->nicks = n;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
 }
 
-static int
-name_rm(const char *chan, const char *name) {
-	Channel *c;
-	Nick *n, *pn = NULL;
+static long long
+uptime_ns(void)
+{
+	struct timespec ts;
 
-        if(!(c = channel_find(chan)))
-                return 0;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
 
-        for(n = c->nicks; n; pn = n, n = n->next) {
-		if(!strcmp(name, n->name)) {
-                        if(pn)
-                                pn->next = n->next;
-                        else
-                                c->nicks = n->next;
-			free(n);
-			return 1;
-		}
+/* hand a line to the flood control. lines for a channel wait in that
+ * channel's queue; c == NULL means the line is urgent (PONG, QUIT, NICK,
+ * registration) and goes out right away, still paying for its token. */
+static void
+sched_push(Conn *cn, Channel *c, const char *s)
+{
+	Msg *m;
+	size_t len;
+
+	if (!c || floodrate <= 0) {
+		conn_write(cn, s);
+		if (floodrate > 0 && cn->tokens > -floodburst)
+			cn->tokens -= 1;
+		return;
 	}
-	return 0;
+
+	len = strlen(s);
+	if (!(m = malloc(sizeof(Msg) + len + 1))) {
+		fprintf(stderr, "%s: malloc: %s\n", argv0, strerror(errno));
+		exit(1);
+	}
+	m->next = NULL;
+	m->len = len;
+	memcpy(m->buf, s, len + 1);
+
+	if (!c->mq) {
+		c->mq = m;
+		c->rrnext = NULL;
+		if (cn->rrtail)
+			cn->rrtail->rrnext = c;
+		else
+			cn->rrhead = c;
+		cn->rrtail = c;
+	} else {
+		c->mqtail->next = m;
+	}
+	c->mqtail = m;
+	if (++c->nmq >= CHANQ_MAX && !c->inblocked)
+		fifo_block(c, 1);
 }
 
+/* send as many queued lines as the token bucket allows, one per channel in
+ * turn. returns the ms until the next token, or -1 if nothing is waiting. */
 static int
-name_rm3(Channel *c, const char *name, char *prefix) {
-	Nick *n, *pn = NULL;
-
-        for(n = c->nicks; n; pn = n, n = n->next) {
-                if(!strcmp(name, n->name)) {
-                        if(pn)
-                                pn->next = n->next;
-                        else
-                                c->nicks = n->next;
-                        if (prefix)
-                                *prefix = n->prefix;
-			free(n);
-			return 1;
+sched_run(Conn *cn)
+{
+	Channel *c;
+	Msg *m;
+	long long now;
+
+	now = uptime_ms();
+	cn->tokens += (now - cn->refilled) * floodrate / 1000.0;
+	if (cn->tokens > floodburst)
+		cn->tokens = floodburst;
+	cn->refilled = now;
+
+	while ((c = cn->rrhead) && cn->tokens >= 1 &&
+	       cn->sqlen < SENDQ_HIWAT) {
+		m = c->mq;
+		conn_write(cn, m->buf);
+		cn->tokens -= 1;
+
+		c->mq = m->next;
+		free(m);
+		if (--c->nmq < CHANQ_MAX / 2 && c->inblocked)
+			fifo_block(c, 0);
+
+		/* rotate: the channel goes to the back if it has more */
+		cn->rrhead = c->rrnext;
+		if (!cn->rrhead)
+			cn->rrtail = NULL;
+		c->rrnext = NULL;
+		if (c->mq) {
+			if (cn->rrtail)
+				cn->rrtail->rrnext = c;
+			else
+				cn->rrhead = c;
+			cn->rrtail = c;
+		} else {
+			c->mqtail = NULL;
 		}
 	}
-	return 0;
+	if (!cn->rrhead)
+		return -1;
+	if (cn->tokens >= 1)
+		return 0; /* waiting for the send queue, not for tokens */
+	return (int)((1 - cn->tokens) * 1000.0 / floodrate) + 1;
 }
 
+/* c is going away: its queued lines (e.g. the PART sent on /l) move to the
+ * master channel so they are still sent. */
 static void
-name_quit(const char *name, const char *user, const char *text) {
-	Channel *c;
+sched_drop(Conn *cn, Channel *c)
+{
+	Channel **pp, *prev = NULL;
+	Msg *m, *mn;
 
-        for(c = channels; c; c = c->next) {
-		if(*c->name && name_rm3(c, name, NULL)) {
-			snprintf(msg, sizeof(msg), "-!- %s(%s) has quit \"%s\"", name, user, text ? text : "");
-			channel_print(c, msg);
+	if (!c->mq)
+		return;
+	for (pp = &cn->rrhead; *pp; prev = *pp, pp = &(*pp)->rrnext) {
+		if (*pp == c) {
+			*pp = c->rrnext;
+			if (cn->rrtail == c)
+				cn->rrtail = prev;
+			break;
 		}
 	}
+	for (m = c->mq; m; m = mn) {
+		mn = m->next;
+		if (cn->channelmaster && c != cn->channelmaster)
+			sched_push(cn, cn->channelmaster, m->buf);
+		free(m);
+	}
+	c->mq = c->mqtail = NULL;
+	c->nmq = 0;
 }
 
+#ifdef USE_EPOLL
 static void
-name_nick(const char *old, const char *new) {
-        Channel *c;
-        char tmp;
-
-        for(c = channels; c; c = c->next) {
-		if(*c->name && name_rm3(c, old, &tmp)) {
-			name_add3(c->name, new, tmp);
-			snprintf(msg, sizeof(msg), "-!- %s changed nick to \"%s\"", old, new);
-			channel_print(c, msg);
-		}
+ev_init(void)
+{
+#ifdef USE_IOURING
+	if (uev_init() == 0)
+		return;
+#endif
+	if ((epfd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+		fprintf(stderr, "%s: epoll_create1: %s\n", argv0, strerror(errno));
+		exit(1);
 	}
 }
 
-static void
-name_menick(const char* old, const char *new) {
-        Channel *c;
-        char tmp;
+static int
+ev_ctl(int op, int fd, void *src, int flags)
+{
+	struct epoll_event ev;
 
-        snprintf(msg, sizeof(msg), "-!- changed nick to \"%s\"", new);
+	memset(&ev, 0, sizeof(ev));
+	ev.events = (flags & EV_READ ? EPOLLIN : 0) |
+	            (flags & EV_WRITE ? EPOLLOUT : 0);
+	ev.data.ptr = src;
+	return epoll_ctl(epfd, op, fd, &ev);
+}
 
-        for(c = channels; c; c = c->next) {
-		if(*c->name && name_rm3(c, old, &tmp)) {
-			name_add3(c->name, new, tmp);
-		}
-                channel_print(c, msg);
-        }
+/* register fd for flags; src is handed back by ev_wait() when it is ready */
+static int
+ev_add(int fd, void *src, int flags)
+{
+#ifdef USE_IOURING
+	if (ur.fd != -1)
+		return uev_add(fd, src, flags);
+#endif
+	return ev_ctl(EPOLL_CTL_ADD, fd, src, flags);
 }
 
 static int
-ptr_split(const char *n, const char *p1, const char *p2, const char *p3) {
-        int ret;
+ev_mod(int fd, void *src, int flags)
+{
+#ifdef USE_IOURING
+	if (ur.fd != -1)
+		return uev_mod(fd, src, flags);
+#endif
+	return ev_ctl(EPOLL_CTL_MOD, fd, src, flags);
+}
 
-        if (n < p1)
-                ret = 1;
-        else if (n > p1 && n < p2)
-                ret = 2;
-        else if (n > p2 && n < p3)
-                ret = 3;
-        else /* n > p3 */
-                ret = 4;
+static int
+ev_wait(int timeout)
+{
+	struct epoll_event evs[EV_MAX];
+	int i, n;
 
-        return ret;
+#ifdef USE_IOURING
+	if (ur.fd != -1)
+		return uev_wait(timeout);
+#endif
+	nevready = 0;
+	if ((n = epoll_wait(epfd, evs, EV_MAX, timeout)) <= 0)
+		return n;
+	for (i = 0; i < n; i++) {
+		evready[i].src = evs[i].data.ptr;
+		evready[i].flags =
+			(evs[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR) ? EV_READ : 0) |
+			(evs[i].events & (EPOLLOUT | EPOLLHUP | EPOLLERR) ? EV_WRITE : 0);
+	}
+	return nevready = n;
 }
-
+#else
 static void
-name_mode(const char *chan, char *mode, char *args) {
-        Channel *c;
-        Nick *n;
-        char *m, *p, *c1, *c2, *c3, *s;
-        int adding = 1;
-
-        if (!(c = channel_find(chan)))
-                return;
+ev_init(void)
+{
+}
 
-        if (!mode) /* invalid arguments */
-                return;
+static int
+ev_add(int fd, void *src, int flags)
+{
+	struct pollfd *fds;
+	void **srcs;
+	size_t cap;
+
+	if (nevfds == evfdscap) {
+		cap = evfdscap ? evfdscap * 2 : 16;
+		if (!(fds = realloc(evfds, cap * sizeof(*evfds))) ||
+		    !(srcs = realloc(evsrcs, cap * sizeof(*evsrcs)))) {
+			fprintf(stderr, "%s: realloc: %s\n", argv0, strerror(errno));
+			exit(1);
+		}
+		evfds = fds;
+		evsrcs = srcs;
+		evfdscap = cap;
+	}
+	evfds[nevfds].fd = fd;
+	evfds[nevfds].revents = 0;
+	evsrcs[nevfds++] = src;
+	return ev_mod(fd, src, flags);
+}
 
-        p = strtok(args, " ");
-        if (p == NULL) /* none of the modes have arguments */
-                return;
+static int
+ev_mod(int fd, void *src, int flags)
+{
+	size_t i;
+
+	for (i = 0; i < nevfds; i++) {
+		if (evfds[i].fd == fd) {
+			evfds[i].events = (flags & EV_READ ? POLLIN : 0) |
+			                  (flags & EV_WRITE ? POLLOUT : 0);
+			evsrcs[i] = src;
+			return 0;
+		}
+	}
+	errno = ENOENT;
+	return -1;
+}
 
-        /* find our comma delimiters. we can guarantee that all three
-         * will be here from the parsing of the 005 line. */
-        c1 = strchr(cmodes, ',');
-        c2 = strchr(c1 + 1, ',');
-        c3 = strchr(c2 + 1, ',');
-        
-        for (m = mode; *m; m++) {
-                switch (*m) {
-                case '+':
-                        adding = 1;
-                        break;
-                case '-':
-                        adding = 0;
-                        break;
-                default:
-                        if (((s = strchr(cmodes, *m)) != NULL) && *m != ',') {
-                                /* work out whether we need to skip arguments */
-                                switch (ptr_split(s, c1, c2, c3)) {
-                                case 1:
-                                case 2:
-                                        p = strtok(NULL, " ");
-                                        break;
-                                case 3: /* FALLTHROUGH */
-                                        if (adding)
-                                                p = strtok(NULL, " ");
-                                case 4:
-                                        break;
-                                }
-                        } else if ((s = strchr(umodes, *m)) != NULL) {
-                                if (p == NULL) /* jumped off a cliff?? */
-                                        return;
+static int
+ev_wait(int timeout)
+{
+	size_t i;
+	int n, re;
+
+	nevready = 0;
+	if ((n = poll(evfds, nevfds, timeout)) <= 0)
+		return n;
+	for (i = 0; i < nevfds && nevready < EV_MAX; i++) {
+		if (!(re = evfds[i].revents))
+			continue;
+		evready[nevready].src = evsrcs[i];
+		evready[nevready++].flags =
+			(re & (POLLIN | POLLHUP | POLLERR) ? EV_READ : 0) |
+			(re & (POLLOUT | POLLHUP | POLLERR) ? EV_WRITE : 0);
+	}
+	return nevready;
+}
+#endif /* USE_EPOLL */
 
-                                n = name_find(c, p);
-                                if (n) {
-                                        if (adding &&
-                                            n->prefix == '\0')
-                                                n->prefix = upref[s - umodes];
-                                        else if (!adding &&
-                                                 (n->prefix == upref[s - umodes])) {
-                                                         n->prefix = '\0';
-                                        }
-                                }
+#ifdef USE_IOURING
+/* io_uring(7) without liburing: map the rings of a new instance. only
+ * kernels with a single mmap for both rings and timeouts for the wait
+ * (5.11) are used; -1 otherwise, and the caller falls back. */
+static int
+uring_init(Uring *u, unsigned entries)
+{
+	struct io_uring_params p;
+	size_t len;
+	char *q;
+
+	memset(&p, 0, sizeof(p));
+	p.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_COOP_TASKRUN;
+	u->fd = syscall(__NR_io_uring_setup, entries, &p);
+	if (u->fd == -1 && errno == EINVAL) {
+		/* before 6.0 */
+		memset(&p, 0, sizeof(p));
+		u->fd = syscall(__NR_io_uring_setup, entries, &p);
+	}
+	if (u->fd == -1)
+		return -1;
+	if (!(p.features & IORING_FEAT_SINGLE_MMAP) ||
+	    !(p.features & IORING_FEAT_NODROP) ||
+	    !(p.features & IORING_FEAT_EXT_ARG))
+		goto fail;
+
+	len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	if (len < p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe))
+		len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if ((q = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+	    u->fd, IORING_OFF_SQ_RING)) == MAP_FAILED)
+		goto fail;
+	if ((u->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+	    PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd,
+	    IORING_OFF_SQES)) == MAP_FAILED) {
+		munmap(q, len);
+		goto fail;
+	}
+	u->sqhead = (unsigned *)(q + p.sq_off.head);
+	u->sqtail = (unsigned *)(q + p.sq_off.tail);
+	u->sqmask = (unsigned *)(q + p.sq_off.ring_mask);
+	u->sqarray = (unsigned *)(q + p.sq_off.array);
+	u->cqhead = (unsigned *)(q + p.cq_off.head);
+	u->cqtail = (unsigned *)(q + p.cq_off.tail);
+	u->cqmask = (unsigned *)(q + p.cq_off.ring_mask);
+	u->cqes = (struct io_uring_cqe *)(q + p.cq_off.cqes);
+	u->entries = p.sq_entries;
+	u->sqnext = *u->sqtail;
+	return 0;
+fail:
+	close(u->fd);
+	u->fd = -1;
+	errno = ENOSYS;
+	return -1;
+}
 
-                                p = strtok(NULL, " ");
-                        }
-                        
-                        break;
-                }
-        }
+/* a cleared submission queue entry; submitted by the next uring_enter() */
+static struct io_uring_sqe *
+uring_sqe(Uring *u)
+{
+	struct io_uring_sqe *sqe;
+	unsigned i;
+
+	if (u->sqnext - __atomic_load_n(u->sqhead, __ATOMIC_ACQUIRE) >= u->entries)
+		uring_enter(u, 0, -1); /* full: make room */
+	i = u->sqnext++ & *u->sqmask;
+	u->sqarray[i] = i;
+	sqe = &u->sqes[i];
+	memset(sqe, 0, sizeof(*sqe));
+	return sqe;
 }
 
-static Nick *
-name_find(Channel *c, const char *name)
+/* submit what is queued and wait for at least wait completions, at most
+ * timeout ms if timeout >= 0. -1 with ETIME if the time ran out. */
+static int
+uring_enter(Uring *u, unsigned wait, int timeout)
 {
-        Nick *n;
+	struct io_uring_getevents_arg arg;
+	struct __kernel_timespec ts;
+	unsigned flags = wait ? IORING_ENTER_GETEVENTS : 0;
+
+	__atomic_store_n(u->sqtail, u->sqnext, __ATOMIC_RELEASE);
+	memset(&arg, 0, sizeof(arg));
+	if (wait && timeout >= 0) {
+		ts.tv_sec = timeout / 1000;
+		ts.tv_nsec = (timeout % 1000) * 1000000LL;
+		arg.ts = (unsigned long)&ts;
+	}
+	return syscall(__NR_io_uring_enter, u->fd,
+	               u->sqnext - __atomic_load_n(u->sqhead, __ATOMIC_ACQUIRE),
+	               wait, flags | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+}
 
-        if (!c || !name)
-                return NULL;
-        
-	for (n = c->nicks; n; n = n->next) {
-		if (!strcmp(name, n->name))
-                        return n; /* found */
+/* give the receive buffers of the last batch of events back to the kernel */
+static void
+ubuf_recycle(void)
+{
+	struct io_uring_buf *b;
+	int i;
+
+	for (i = 0; i < nubufdone; i++) {
+		b = &ubufring->bufs[ubuftail++ & (UBUF_COUNT - 1)];
+		b->addr = (unsigned long)(ubufs + ubufdone[i] * UBUF_SIZE);
+		b->len = UBUF_SIZE;
+		b->bid = ubufdone[i];
 	}
-	return NULL;
+	nubufdone = 0;
+	__atomic_store_n(&ubufring->tail, ubuftail, __ATOMIC_RELEASE);
 }
 
+/* the event loop on io_uring: server sockets are read by a multishot
+ * receive into a ring of provided buffers and everything else is watched
+ * with one-shot polls. a poll that fired is added again with the next
+ * submission, after the event was handled, which keeps the level-triggered
+ * behaviour of epoll that the FIFOs (read a line at a time) rely on. a busy
+ * loop iteration costs a single io_uring_enter(2). needs 5.19 for the
+ * buffer ring, else epoll is used. */
 static int
-udsopen(const char *uds)
+uev_init(void)
 {
-	struct sockaddr_un sun;
-	size_t len;
-	int fd;
+	struct io_uring_buf_reg reg;
+	int i;
 
-	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
-		fprintf(stderr, "%s: socket: %s\n", argv0, strerror(errno));
-		exit(1);
-	}
+	if (uring_init(&ur, 256) == -1)
+		return -1;
+	ubufring = mmap(NULL, UBUF_COUNT * sizeof(struct io_uring_buf),
+	                PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (ubufring == MAP_FAILED || !(ubufs = malloc(UBUF_COUNT * UBUF_SIZE)))
+		goto fail;
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (unsigned long)ubufring;
+	reg.ring_entries = UBUF_COUNT;
+	reg.bgid = 0;
+	if (syscall(__NR_io_uring_register, ur.fd, IORING_REGISTER_PBUF_RING,
+	    &reg, 1) == -1)
+		goto fail;
+	for (i = 0; i < UBUF_COUNT; i++)
+		ubufdone[nubufdone++] = i;
+	ubuf_recycle();
+	return 0;
+fail:
+	close(ur.fd);
+	ur.fd = -1;
+	return -1;
+}
 
-	sun.sun_family = AF_UNIX;
-	if (strlcpy(sun.sun_path, uds, sizeof(sun.sun_path)) >= sizeof(sun.sun_path)) {
-		fprintf(stderr, "%s: UNIX domain socket path truncation\n", argv0);
-		exit(1);
+/* bring the requests for fd in line with what its registration asks for */
+static void
+uev_arm(int fd)
+{
+	struct io_uring_sqe *sqe;
+	Ureg *g = &uregs[fd];
+	int want = 0;
+
+	if (g->src) {
+		want = (g->flags & EV_WRITE ? POLLOUT : 0) |
+		       (g->flags & EV_READ && !g->sock ? POLLIN : 0);
+		if (g->flags & EV_READ && g->sock && !g->recv) {
+			sqe = uring_sqe(&ur);
+			sqe->opcode = IORING_OP_RECV;
+			sqe->fd = fd;
+			sqe->ioprio = IORING_RECV_MULTISHOT;
+			sqe->flags = IOSQE_BUFFER_SELECT;
+			sqe->buf_group = 0;
+			sqe->user_data = UD(UD_RECV, fd, g->gen);
+			g->recv = 1;
+		}
+	} else if (g->recv) {
+		sqe = uring_sqe(&ur);
+		sqe->opcode = IORING_OP_ASYNC_CANCEL;
+		sqe->addr = UD(UD_RECV, fd, g->gen);
+		sqe->user_data = UD(UD_CANCEL, fd, 0);
+		g->recv = 0;
 	}
-	len = strlen(sun.sun_path) + 1 + sizeof(sun.sun_family);
-	if (connect(fd, (struct sockaddr *)&sun, len) == -1) {
-		fprintf(stderr, "%s: connect: %s\n", argv0, strerror(errno));
-		exit(1);
+	if (want == g->poll)
+		return;
+	if (g->poll) {
+		sqe = uring_sqe(&ur);
+		sqe->opcode = IORING_OP_POLL_REMOVE;
+		sqe->addr = UD(UD_POLL, fd, g->pgen);
+		sqe->user_data = UD(UD_CANCEL, fd, 0);
+	}
+	g->pgen++;
+	if ((g->poll = want)) {
+		sqe = uring_sqe(&ur);
+		sqe->opcode = IORING_OP_POLL_ADD;
+		sqe->fd = fd;
+		sqe->poll32_events = want;
+		sqe->user_data = UD(UD_POLL, fd, g->pgen);
 	}
-	return fd;
 }
 
 static int
-tcpopen(const char *host, const char *service)
+uev_add(int fd, void *src, int flags)
 {
-	struct addrinfo hints, *res = NULL, *rp;
-	int fd = -1, e;
+	struct stat st;
+	Ureg *g;
+	size_t n;
 
-	memset(&hints, 0, sizeof(hints));
-	hints.ai_family = AF_UNSPEC; /* allow IPv4 or IPv6 */
-	hints.ai_flags = AI_NUMERICSERV; /* avoid name lookup for port */
-	hints.ai_socktype = SOCK_STREAM;
+	if ((size_t)fd >= nuregs) {
+		n = fd + 16;
+		if (!(g = realloc(uregs, n * sizeof(*uregs))))
+			return -1;
+		memset(g + nuregs, 0, (n - nuregs) * sizeof(*uregs));
+		uregs = g;
+		nuregs = n;
+	}
+	g = &uregs[fd];
+	g->src = src;
+	g->flags = flags;
+	g->sock = fstat(fd, &st) == 0 && S_ISSOCK(st.st_mode);
+	uev_arm(fd);
+	return 0;
+}
 
-	if ((e = getaddrinfo(host, service, &hints, &res))) {
-		fprintf(stderr, "%s: getaddrinfo: %s\n", argv0, gai_strerror(e));
-		exit(1);
+static int
+uev_mod(int fd, void *src, int flags)
+{
+	if ((size_t)fd >= nuregs || !uregs[fd].src) {
+		errno = ENOENT;
+		return -1;
 	}
+	uregs[fd].src = src;
+	uregs[fd].flags = flags;
+	uev_arm(fd);
+	return 0;
+}
 
-	for (rp = res; rp; rp = rp->ai_next) {
-		fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
-		if (fd == -1)
-			continue;
-		if (connect(fd, res->ai_addr, res->ai_addrlen) == -1) {
-			close(fd);
-			fd = -1;
-			continue;
+static void
+uev_del(int fd)
+{
+	if ((size_t)fd >= nuregs || !uregs[fd].src)
+		return;
+	uregs[fd].src = NULL;
+	uev_arm(fd);
+	uregs[fd].gen++; /* data still on its way is for a closed connection */
+}
+
+/* add an event for src, merging readiness with an earlier one */
+static void
+uev_push(void *src, int flags, const char *data, ssize_t len)
+{
+	int i;
+
+	for (i = 0; !(flags & EV_DATA) && i < nevready; i++) {
+		if (evready[i].src == src && !(evready[i].flags & EV_DATA)) {
+			evready[i].flags |= flags;
+			return;
+		}
+	}
+	evready[nevready].src = src;
+	evready[nevready].flags = flags;
+	evready[nevready].data = data;
+	evready[nevready++].len = len;
+}
+
+static int
+uev_wait(int timeout)
+{
+	struct io_uring_cqe *cqe;
+	unsigned head, tail, gen;
+	Ureg *g;
+	int fd, re, bid;
+
+	nevready = 0;
+	ubuf_recycle();
+	if (uring_enter(&ur, 1, timeout) == -1 && errno != ETIME)
+		return -1;
+
+	head = *ur.cqhead;
+	tail = __atomic_load_n(ur.cqtail, __ATOMIC_ACQUIRE);
+	for (; head != tail && nevready < EV_MAX; head++) {
+		cqe = &ur.cqes[head & *ur.cqmask];
+		fd = (int)(cqe->user_data & 0xffffffff);
+		gen = (cqe->user_data >> 32) & 0xffffff;
+		g = (size_t)fd < nuregs ? &uregs[fd] : NULL;
+		switch (cqe->user_data >> 56) {
+		case UD_POLL:
+			if (!g || !g->src || gen != (g->pgen & 0xffffff))
+				break;
+			g->poll = 0;
+			uev_arm(fd);
+			if ((re = cqe->res) < 0)
+				break;
+			uev_push(g->src,
+				(re & (POLLIN | POLLHUP | POLLERR) ? EV_READ : 0) |
+				(re & (POLLOUT | POLLHUP | POLLERR) ? EV_WRITE : 0),
+				NULL, 0);
+			break;
+		case UD_RECV:
+			bid = -1;
+			if (cqe->flags & IORING_CQE_F_BUFFER)
+				ubufdone[nubufdone++] = bid =
+					cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+			if (!g || !g->src || gen != (g->gen & 0xffffff))
+				break;
+			if (!(cqe->flags & IORING_CQE_F_MORE))
+				g->recv = 0;
+			if (cqe->res == -ENOBUFS) {
+				/* all buffers in use: again after recycling */
+				uev_arm(fd);
+			} else if (cqe->res == -EINVAL) {
+				/* no multishot receive (before 6.0) */
+				g->sock = 0;
+				uev_arm(fd);
+			} else if (cqe->res != -ECANCELED) {
+				uev_push(g->src, EV_DATA, bid == -1 ? NULL :
+				         ubufs + bid * UBUF_SIZE, cqe->res);
+				if (cqe->res > 0 && !g->recv)
+					uev_arm(fd);
+			}
+			break;
 		}
-		break; /* success */
 	}
-	if (fd == -1) {
-		fprintf(stderr, "%s: could not connect to %s:%s: %s\n",
-			argv0, host, service, strerror(errno));
+	__atomic_store_n(ur.cqhead, head, __ATOMIC_RELEASE);
+	return nevready;
+}
+#endif /* USE_IOURING */
+
+/* unregister fd (if >= 0) and forget pending events for src, which is
+ * about to go away. */
+static void
+ev_del(int fd, void *src)
+{
+	int i;
+
+#ifdef USE_EPOLL
+#ifdef USE_IOURING
+	if (fd >= 0 && ur.fd != -1)
+		uev_del(fd);
+	else
+#endif
+	if (fd >= 0)
+		epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
+#else
+	size_t j;
+
+	for (j = 0; fd >= 0 && j < nevfds; j++) {
+		if (evfds[j].fd == fd) {
+			evfds[j] = evfds[--nevfds];
+			evsrcs[j] = evsrcs[nevfds];
+			break;
+		}
+	}
+#endif
+	for (i = 0; src && i < nevready; i++) {
+		if (evready[i].src == src)
+			evready[i].src = NULL;
+	}
+}
+
+/* creates directories bottom-up, if necessary */
+static void
+create_dirtree(const char *dir)
+{
+	char tmp[PATH_MAX], *p;
+	struct stat st;
+	size_t len;
+
+	strlcpy(tmp, dir, sizeof(tmp));
+	len = strlen(tmp);
+	if (len > 0 && tmp[len - 1] == '/')
+		tmp[len - 1] = '\0';
+
+	if ((stat(tmp, &st) != -1) && S_ISDIR(st.st_mode))
+		return; /* dir exists */
+
+	for (p = tmp + 1; *p; p++) {
+		if (*p != '/')
+			continue;
+		*p = '\0';
+		mkdir(tmp, S_IRWXU);
+		*p = '/';
+	}
+	mkdir(tmp, S_IRWXU);
+}
+
+static void
+channel_normalize_path(char *s)
+{
+	for (; *s; s++) {
+		if (isalpha(*s))
+			*s = tolower(*s);
+		else if (!isdigit(*s) && !strchr(".#&+!-", *s))
+			*s = '_';
+	}
+}
+
+static void
+channel_normalize_name(const Conn *cn, char *s)
+{
+	char *p;
+
+	/* corner case for channelmaster */
+	if (*s == '\0')
+		return;
+
+	/* advance over the channel prefix char (&#) and any possible prefix
+	 * characters if we have received a message for opers
+	 * (e.g. NOTICE @#chan :hey ops) */
+        while (*s == '&' || *s == '#' || strchr(cn->upref, s[0]) != NULL)
+		s++;
+	for (p = s; *s; s++) {
+		/* sanitise the channel name of invalid chars and downcase
+		 * alphanumerics */
+		if (!strchr(" ,&#\x07", *s)) {
+			*p = isalpha(*s) ? tolower(*s) : *s;
+			p++;
+		}
+	}
+	*p = '\0';
+}
+
+static void
+create_filepath(char *filepath, size_t len, const char *path,
+	const char *channel, const char *suffix)
+{
+	int r;
+
+	if (channel[0]) {
+		r = snprintf(filepath, len, "%s/%s/%s", path, channel, suffix);
+		if (r < 0 || (size_t)r >= len)
+			goto error;
+	} else {
+		r = snprintf(filepath, len, "%s/%s", path, suffix);
+		if (r < 0 || (size_t)r >= len)
+			goto error;
+	}
+	return;
+
+error:
+	fprintf(stderr, "%s: path to irc directory too long\n", argv0);
+	exit(1);
+}
+
+static int
+channel_open(Channel *c)
+{
+	char in[PATH_MAX];
+	int fd, dirfd = c->out->dir->fd;
+	struct stat st;
+
+	out_relpath(c->out, "in", in, sizeof(in));
+	/* make "in" fifo if it doesn't exist already. */
+	if (fstatat(dirfd, in, &st, AT_SYMLINK_NOFOLLOW) != -1) {
+		if (!(st.st_mode & S_IFIFO))
+			return -1;
+	} else if (mkfifoat(dirfd, in, S_IRWXU)) {
+		return -1;
+	}
+	c->fdin = -1;
+	fd = openat(dirfd, in, O_RDONLY | O_NONBLOCK, 0);
+	if (fd == -1)
+		return -1;
+	if (!c->cn->fifosblocked && ev_add(fd, c, EV_READ) == -1) {
+		close(fd);
+		return -1;
+	}
+	c->fdin = fd;
+
+	return 0;
+}
+
+static int
+channel_reopen(Channel *c)
+{
+	if (c->fdin > 2) {
+		ev_del(c->fdin, NULL);
+		close(c->fdin);
+		c->fdin = -1;
+	}
+	return channel_open(c);
+}
+
+static Channel *
+channel_new(Conn *cn, const char *name)
+{
+	Channel *c;
+	char channelpath[PATH_MAX];
+
+	strlcpy(channelpath, name, sizeof(channelpath));
+	channel_normalize_path(channelpath);
+
+	if (!(c = calloc(1, sizeof(Channel)))) {
+		fprintf(stderr, "%s: calloc: %s\n", argv0, strerror(errno));
+		exit(1);
+	}
+	c->srctype = SRC_CHANNEL;
+	c->cn = cn;
+	c->next = NULL;
+	if (!(c->out = calloc(1, sizeof(Outfile)))) {
+		fprintf(stderr, "%s: calloc: %s\n", argv0, strerror(errno));
+		exit(1);
+	}
+	c->out->fd = c->out->idxfd = -1;
+	strlcpy(c->name, name, sizeof(c->name));
+	channel_normalize_name(cn, c->name);
+	c->hash = strhash(c->name);
+
+	create_filepath(c->out->path, sizeof(c->out->path), cn->ircpath,
+	                channelpath, "out");
+	/* the server directory exists: one mkdirat(2) instead of walking the
+	 * whole path, and the files of the channel are opened relative to it */
+	strlcpy(c->out->sub, channelpath, sizeof(c->out->sub));
+	if (c->out->sub[0])
+		mkdirat(cn->dir->fd, c->out->sub, S_IRWXU);
+	c->out->dir = cn->dir;
+	__atomic_fetch_add(&cn->dir->refs, 1, __ATOMIC_RELAXED);
+	return c;
+}
+
+/* FNV-1a */
+static unsigned long
+strhash(const char *s)
+{
+	unsigned long h = 2166136261UL;
+
+	for (; *s; s++)
+		h = (h ^ (unsigned char)*s) * 16777619UL;
+	return h;
+}
+
+static void
+chantab_add(Channel *c)
+{
+	Conn *cn = c->cn;
+	Channel **tab, *p, *pn;
+	size_t i, size;
+
+	if (cn->nchantab >= cn->chantabsize) {
+		size = cn->chantabsize ? cn->chantabsize * 2 : CHANTAB_MIN;
+		if (!(tab = calloc(size, sizeof(*tab)))) {
+			fprintf(stderr, "%s: calloc: %s\n", argv0, strerror(errno));
+			exit(1);
+		}
+		for (i = 0; i < cn->chantabsize; i++) {
+			for (p = cn->chantab[i]; p; p = pn) {
+				pn = p->hnext;
+				p->hnext = tab[p->hash & (size - 1)];
+				tab[p->hash & (size - 1)] = p;
+			}
+		}
+		free(cn->chantab);
+		cn->chantab = tab;
+		cn->chantabsize = size;
+	}
+	i = c->hash & (cn->chantabsize - 1);
+	c->hnext = cn->chantab[i];
+	cn->chantab[i] = c;
+	cn->nchantab++;
+}
+
+static void
+chantab_rm(Channel *c)
+{
+	Conn *cn = c->cn;
+	Channel **pp;
+
+	if (!cn->chantabsize)
+		return;
+	for (pp = &cn->chantab[c->hash & (cn->chantabsize - 1)]; *pp; pp = &(*pp)->hnext) {
+		if (*pp == c) {
+			*pp = c->hnext;
+			cn->nchantab--;
+			return;
+		}
+	}
+}
+
+static Channel *
+channel_find(Conn *cn, const char *name)
+{
+	Channel *c;
+	char chan[IRC_CHANNEL_MAX];
+	unsigned long h;
+
+	if (!cn->chantabsize)
+		return NULL;
+	strlcpy(chan, name, sizeof(chan));
+	channel_normalize_name(cn, chan);
+	h = strhash(chan);
+	for (c = cn->chantab[h & (cn->chantabsize - 1)]; c; c = c->hnext) {
+		if (c->hash == h && !strcmp(chan, c->name))
+			return c; /* already handled */
+	}
+	return NULL;
+}
+
+static Channel *
+channel_add(Conn *cn, const char *name)
+{
+	Channel *c;
+
+	c = channel_new(cn, name);
+	if (channel_open(c) == -1) {
+		fprintf(stderr, "%s: cannot create channel: %s: %s\n",
+		         argv0, name, strerror(errno));
+		dir_release(c->out->dir);
+		free(c->out);
+		free(c);
+		return NULL;
+	}
+	if (!cn->channels) {
+		cn->channels = c;
+	} else {
+		c->next = cn->channels;
+		cn->channels = c;
+        }
+	chantab_add(c);
+	return c;
+}
+
+static Channel *
+channel_join(Conn *cn, const char *name)
+{
+	Channel *c;
+
+	if (!(c = channel_find(cn, name)))
+		c = channel_add(cn, name);
+	return c;
+}
+
+static void
+channel_rm(Channel *c)
+{
+        Conn *cn = c->cn;
+        Channel *p;
+        size_t i;
+
+	outq_ctl(c->out, OUT_CLOSE);
+	ev_del(c->fdin, c);
+	sched_drop(cn, c);
+	chantab_rm(c);
+	if (cn->channelmaster == c)
+		cn->channelmaster = NULL;
+	if (cn->channels == c) {
+		cn->channels = cn->channels->next;
+	} else {
+		for (p = cn->channels; p && p->next != c; p = p->next)
+			;
+		if (p && p->next == c)
+			p->next = c->next;
+        }
+
+        for (i = 0; i < c->nickssize; i++) {
+                if (c->nicks[i])
+                        name_free(c->nicks[i]);
+        }
+        free(c->nicks);
+
+        free(c);
+}
+
+static void
+channel_leave(Channel *c)
+{
+	char in[PATH_MAX];
+
+	if (c->fdin > 2) {
+		ev_del(c->fdin, c);
+		close(c->fdin);
+		c->fdin = -1;
+	}
+	/* remove "in" file on leaving the channel */
+	unlinkat(c->out->dir->fd, out_relpath(c->out, "in", in, sizeof(in)), 0);
+	channel_rm(c);
+}
+
+static void
+loginkey(Conn *cn, const char *key)
+{
+	snprintf(msg, sizeof(msg), "PASS %s\r\n", key);
+	sched_push(cn, NULL, msg);
+}
+
+static void
+loginuser(Conn *cn)
+{
+	size_t len;
+	char *p;
+
+	len = snprintf(msg, sizeof(msg), "NICK %s\r\nUSER %s localhost %s :%s\r\n",
+	               cn->nick, cn->username, cn->host,
+	               cn->fullname && *cn->fullname ? cn->fullname : cn->username);
+	if (len >= sizeof(msg))
+		len = sizeof(msg) - 1;
+	if ((p = outq_reserve(len + 1, 0))) {
+		memcpy(p, msg, len);
+		p[len] = '\n';
+		outq_commit(NULL, OUT_LINE, len + 1);
+	}
+	sched_push(cn, NULL, msg);
+}
+
+/* index of the slot holding name in c->nicks, or of the empty slot where it
+ * would go. c->nicks must have been allocated. */
+static size_t
+name_slot(const Channel *c, const char *name, unsigned long h)
+{
+        size_t i, mask = c->nickssize - 1;
+
+        for (i = h & mask; c->nicks[i]; i = (i + 1) & mask) {
+                if (c->nicks[i]->user->hash == h &&
+                    !strcmp(name, c->nicks[i]->user->name))
+                        break;
+        }
+        return i;
+}
+
+/* forget all names of c, e.g. when the connection is gone */
+static void
+name_clear(Channel *c)
+{
+	size_t i;
+
+	for (i = 0; i < c->nickssize; i++) {
+		if (c->nicks[i]) {
+			name_free(c->nicks[i]);
+			c->nicks[i] = NULL;
+		}
+	}
+	c->nnicks = 0;
+}
+
+static void
+name_add3(Channel *c, const char *name, const char modes) {
+        Nick *n, **tab;
+        const char *p;
+        size_t i, j, size;
+        unsigned long h;
+
+        if (!c)
+                return;
+
+        p = name;
+        if (strchr(c->cn->upref, p[0]) != NULL) {
+                name++;
+        }
+
+        h = strhash(name);
+        if (c->nnicks) {
+                i = name_slot(c, name, h);
+                if ((n = c->nicks[i])) {
+			/* name already exists in the channel, but twiddle prefix
+			 * characters in case they've changed without us knowing.
+			 * this also means that /NAMES can be used to reset nick
+			 * state if we get confused. */
+			if (trackprefix && p != name) {
+				n->prefix = *p;
+			}
+			return;
+		}
+	}
+
+        /* keep the set at most half full */
+        if ((c->nnicks + 1) * 2 > c->nickssize) {
+                size = c->nickssize ? c->nickssize * 2 : NICKSET_MIN;
+                if (!(tab = calloc(size, sizeof(*tab)))) {
+                        fprintf(stderr, "%s: calloc: %s\n", argv0, strerror(errno));
+                        exit(1);
+                }
+                for (i = 0; i < c->nickssize; i++) {
+                        if (!(n = c->nicks[i]))
+                                continue;
+                        j = n->user->hash & (size - 1);
+                        while (tab[j])
+                                j = (j + 1) & (size - 1);
+                        tab[j] = n;
+                }
+                free(c->nicks);
+                c->nicks = tab;
+                c->nickssize = size;
+        }
+
+        if (!(n = calloc(1, sizeof(Nick)))) {
+		fprintf(stderr, "%s: calloc: %s\n", argv0, strerror(errno));
+		exit(1);
+	}
+
+        if (trackprefix && p != name) {
+                /* special people get prefix chars */
+                n->prefix = *p;
+        } else {
+                n->prefix = modes;
+        }
+        
+        n->user = user_get(c->cn, name);
+        n->chan = c;
+        n->unext = n->user->chans;
+        if (n->unext)
+                n->unext->uprev = n;
+        n->user->chans = n;
+        c->nicks[name_slot(c, n->user->name, n->user->hash)] = n;
+        c->nnicks++;
+}
+
+/* unlink a membership from its user, dropping the user with the last one */
+static void
+name_free(Nick *n)
+{
+        if (n->uprev)
+                n->uprev->unext = n->unext;
+        else
+                n->user->chans = n->unext;
+        if (n->unext)
+                n->unext->uprev = n->uprev;
+        if (!n->user->chans)
+                user_rm(n->chan->cn, n->user);
+        free(n);
+}
+
+static int
+name_rm(Conn *cn, const char *chan, const char *name) {
+        return name_rm3(channel_find(cn, chan), name, NULL);
+}
+
+static int
+name_rm3(Channel *c, const char *name, char *prefix) {
+	Nick *n;
+        size_t i, j, k, mask;
+
+        if (!c || !c->nnicks)
+                return 0;
+
+        i = name_slot(c, name, strhash(name));
+        if (!(n = c->nicks[i]))
+                return 0;
+        if (prefix)
+                *prefix = n->prefix;
+        name_free(n);
+        c->nicks[i] = NULL;
+        c->nnicks--;
+
+        /* backward shift deletion: move later entries of the probe run
+         * into the hole unless they already sit at or after their home
+         * slot. */
+        mask = c->nickssize - 1;
+        for (j = (i + 1) & mask; c->nicks[j]; j = (j + 1) & mask) {
+                k = c->nicks[j]->user->hash & mask;
+                if ((j > i && (k <= i || k > j)) ||
+                    (j < i && (k <= i && k > j))) {
+                        c->nicks[i] = c->nicks[j];
+                        c->nicks[j] = NULL;
+                        i = j;
+                }
+        }
+	return 1;
+}
+
+static User *
+user_find(Conn *cn, const char *name)
+{
+        User *u;
+        unsigned long h;
+
+        if (!cn->usertabsize)
+                return NULL;
+        h = strhash(name);
+        for (u = cn->usertab[h & (cn->usertabsize - 1)]; u; u = u->hnext) {
+                if (u->hash == h && !strcmp(name, u->name))
+                        return u;
+        }
+        return NULL;
+}
+
+/* find a user, creating it if we haven't seen the nick yet */
+static User *
+user_get(Conn *cn, const char *name)
+{
+        User **tab, *u, *un;
+        size_t i, size;
+
+        if ((u = user_find(cn, name)))
+                return u;
+
+        if (cn->nusertab >= cn->usertabsize) {
+                size = cn->usertabsize ? cn->usertabsize * 2 : USERTAB_MIN;
+                if (!(tab = calloc(size, sizeof(*tab)))) {
+                        fprintf(stderr, "%s: calloc: %s\n", argv0, strerror(errno));
+                        exit(1);
+                }
+                for (i = 0; i < cn->usertabsize; i++) {
+                        for (u = cn->usertab[i]; u; u = un) {
+                                un = u->hnext;
+                                u->hnext = tab[u->hash & (size - 1)];
+                                tab[u->hash & (size - 1)] = u;
+                        }
+                }
+                free(cn->usertab);
+                cn->usertab = tab;
+                cn->usertabsize = size;
+        }
+
+        if (!(u = calloc(1, sizeof(User)))) {
+                fprintf(stderr, "%s: calloc: %s\n", argv0, strerror(errno));
+                exit(1);
+        }
+        strlcpy(u->name, name, sizeof(u->name));
+        u->hash = strhash(u->name);
+        i = u->hash & (cn->usertabsize - 1);
+        u->hnext = cn->usertab[i];
+        cn->usertab[i] = u;
+        cn->nusertab++;
+        return u;
+}
+
+static void
+user_rm(Conn *cn, User *u)
+{
+        User **pp;
+
+        for (pp = &cn->usertab[u->hash & (cn->usertabsize - 1)]; *pp; pp = &(*pp)->hnext) {
+                if (*pp == u) {
+                        *pp = u->hnext;
+                        cn->nusertab--;
+                        break;
+                }
+        }
+        free(u);
+}
+
+/* the following only visit the channels the user is actually in. the next
+ * membership is fetched up front since removing the last one frees the
+ * user. */
+static void
+name_quit(Conn *cn, const char *name) {
+	Channel *c;
+        User *u;
+        Nick *n, *nn;
+
+        /* msg holds the line to print */
+        if (!(u = user_find(cn, name)))
+                return;
+        for (n = u->chans; n; n = nn) {
+                nn = n->unext;
+                c = n->chan;
+		if (*c->name && name_rm3(c, name, NULL))
+			channel_print(c, msg);
+	}
+}
+
+static void
+name_nick(Conn *cn, const char *old, const char *new) {
+        Channel *c;
+        User *u;
+        Nick *n, *nn;
+        char tmp;
+
+        if (!(u = user_find(cn, old)))
+                return;
+        snprintf(msg, sizeof(msg), "-!- %s changed nick to \"%s\"", old, new);
+        for (n = u->chans; n; n = nn) {
+                nn = n->unext;
+                c = n->chan;
+		if (*c->name && name_rm3(c, old, &tmp)) {
+			name_add3(c, new, tmp);
+			channel_print(c, msg);
+		}
+	}
+}
+
+static void
+name_menick(Conn *cn, const char* old, const char *new) {
+        Channel *c;
+        User *u;
+        Nick *n, *nn;
+        char tmp;
+
+        if ((u = user_find(cn, old))) {
+                for (n = u->chans; n; n = nn) {
+                        nn = n->unext;
+                        c = n->chan;
+                        if (*c->name && name_rm3(c, old, &tmp))
+                                name_add3(c, new, tmp);
+                }
+        }
+
+        /* our own nick change goes to every window */
+        snprintf(msg, sizeof(msg), "-!- changed nick to \"%s\"", new);
+        for(c = cn->channels; c; c = c->next)
+                channel_print(c, msg);
+}
+
+static int
+ptr_split(const char *n, const char *p1, const char *p2, const char *p3) {
+        int ret;
+
+        if (n < p1)
+                ret = 1;
+        else if (n > p1 && n < p2)
+                ret = 2;
+        else if (n > p2 && n < p3)
+                ret = 3;
+        else /* n > p3 */
+                ret = 4;
+
+        return ret;
+}
+
+static void
+name_mode(Conn *cn, const Ircmsg *m) {
+        Channel *c;
+        Nick *n;
+        const char *c1, *c2, *c3, *s;
+        char chan[IRC_CHANNEL_MAX], nick[IRC_NICK_MAX];
+        size_t i, arg = 2; /* MODE <channel> <modes> <args...> */
+        int adding = 1;
+
+        if (m->nparams < 2) /* invalid arguments */
+                return;
+        if (!(c = channel_find(cn, span_str(m->params[0], chan, sizeof(chan)))))
+                return;
+        if (arg >= m->nparams) /* none of the modes have arguments */
+                return;
+
+        /* find our comma delimiters. we can guarantee that all three
+         * will be here from the parsing of the 005 line. */
+        c1 = strchr(cn->cmodes, ',');
+        c2 = strchr(c1 + 1, ',');
+        c3 = strchr(c2 + 1, ',');
+
+        for (i = 0; i < m->params[1].len; i++) {
+                switch (m->params[1].p[i]) {
+                case '+':
+                        adding = 1;
+                        break;
+                case '-':
+                        adding = 0;
+                        break;
+                case ',':
+                        break;
+                default:
+                        if ((s = memchr(cn->cmodes, m->params[1].p[i],
+                                        strlen(cn->cmodes)))) {
+                                /* work out whether we need to skip arguments */
+                                switch (ptr_split(s, c1, c2, c3)) {
+                                case 1:
+                                case 2:
+                                        arg++;
+                                        break;
+                                case 3:
+                                        if (adding)
+                                                arg++;
+                                        break;
+                                }
+                        } else if ((s = memchr(cn->umodes, m->params[1].p[i],
+                                               strlen(cn->umodes)))) {
+                                if (arg >= m->nparams) /* jumped off a cliff?? */
+                                        return;
+
+                                n = name_find(c, span_str(m->params[arg], nick,
+                                                          sizeof(nick)));
+                                if (n) {
+                                        if (adding &&
+                                            n->prefix == '\0')
+                                                n->prefix = cn->upref[s - cn->umodes];
+                                        else if (!adding &&
+                                                 (n->prefix == cn->upref[s - cn->umodes])) {
+                                                         n->prefix = '\0';
+                                        }
+                                }
+                                arg++;
+                        }
+                        break;
+                }
+        }
+}
+
+static Nick *
+name_find(Channel *c, const char *name)
+{
+        if (!c || !name || !c->nnicks)
+                return NULL;
+        return c->nicks[name_slot(c, name, strhash(name))];
+}
+
+static int
+udsopen(const char *uds)
+{
+	struct sockaddr_un sun;
+	size_t len;
+	int fd;
+
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
+		fprintf(stderr, "%s: socket: %s\n", argv0, strerror(errno));
+		return -1;
+	}
+
+	sun.sun_family = AF_UNIX;
+	if (strlcpy(sun.sun_path, uds, sizeof(sun.sun_path)) >= sizeof(sun.sun_path)) {
+		fprintf(stderr, "%s: UNIX domain socket path truncation\n", argv0);
+		exit(1);
+	}
+	len = strlen(sun.sun_path) + 1 + sizeof(sun.sun_family);
+	if (connect(fd, (struct sockaddr *)&sun, len) == -1) {
+		fprintf(stderr, "%s: connect: %s\n", argv0, strerror(errno));
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/* resolve host to at most max addresses, IPv6 and IPv4 interleaved
+ * beginning with the family the resolver put first, as RFC 8305 wants
+ * them tried. the number found, -1 if none (printed). */
+static int
+addr_resolve(const char *host, const char *service, Addr *a, int max)
+{
+	struct addrinfo hints, *res = NULL, *rp;
+	int e, n, family, used[CONNECT_MAX] = { 0 }, k;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC; /* allow IPv4 or IPv6 */
+	hints.ai_flags = AI_NUMERICSERV; /* avoid name lookup for port */
+	hints.ai_socktype = SOCK_STREAM;
+
+	if ((e = getaddrinfo(host, service, &hints, &res))) {
+		fprintf(stderr, "%s: getaddrinfo: %s: %s\n", argv0, host,
+		        gai_strerror(e));
+		return -1;
+	}
+	if (max > CONNECT_MAX)
+		max = CONNECT_MAX;
+	for (n = 0, family = res->ai_family; n < max; family = family ==
+	     AF_INET6 ? AF_INET : AF_INET6) {
+		/* the next of this family, else of any family left */
+		for (rp = res, k = 0; rp; rp = rp->ai_next, k++) {
+			if (k < CONNECT_MAX && !used[k] && rp->ai_family == family)
+				break;
+		}
+		if (!rp) {
+			for (rp = res, k = 0; rp; rp = rp->ai_next, k++) {
+				if (k < CONNECT_MAX && !used[k])
+					break;
+			}
+			if (!rp)
+				break;
+		}
+		used[k] = 1;
+		if (rp->ai_addrlen > sizeof(a[n].sa))
+			continue;
+		memcpy(&a[n].sa, rp->ai_addr, rp->ai_addrlen);
+		a[n++].len = rp->ai_addrlen;
+	}
+	freeaddrinfo(res);
+	return n;
+}
+
+/* the addresses of the last connection from <dir>/addrs: the time they
+ * were resolved on the first line, then one numeric address per line, the
+ * one connected to last first. the number read, 0 if there is no file. */
+static int
+addr_load(const char *dir, const char *service, Addr *a, int max, time_t *when)
+{
+	struct addrinfo hints, *res;
+	char path[PATH_MAX], line[INET6_ADDRSTRLEN + 2];
+	FILE *fp;
+	int n = 0;
+
+	if (snprintf(path, sizeof(path), "%s/addrs", dir) >= (int)sizeof(path) ||
+	    !(fp = fopen(path, "r")))
+		return 0;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_flags = AI_NUMERICHOST | AI_NUMERICSERV;
+	hints.ai_socktype = SOCK_STREAM;
+	if (fgets(line, sizeof(line), fp))
+		*when = strtoll(line, NULL, 10);
+	while (n < max && fgets(line, sizeof(line), fp)) {
+		line[strcspn(line, "\n")] = '\0';
+		if (getaddrinfo(line, service, &hints, &res))
+			continue;
+		if (res->ai_addrlen <= sizeof(a[n].sa)) {
+			memcpy(&a[n].sa, res->ai_addr, res->ai_addrlen);
+			a[n++].len = res->ai_addrlen;
+		}
+		freeaddrinfo(res);
+	}
+	fclose(fp);
+	return n;
+}
+
+/* write <dir>/addrs, replacing it atomically. tmp names the temporary file,
+ * the main thread and the resolver thread each have their own. */
+static void
+addr_save(const char *dir, const char *tmp, const Addr *a, int n, time_t when)
+{
+	char path[PATH_MAX], tpath[PATH_MAX], host[INET6_ADDRSTRLEN];
+	FILE *fp;
+	int i;
+
+	if (snprintf(path, sizeof(path), "%s/addrs", dir) >= (int)sizeof(path) ||
+	    snprintf(tpath, sizeof(tpath), "%s/%s", dir, tmp) >= (int)sizeof(tpath) ||
+	    !(fp = fopen(tpath, "w")))
+		return;
+	fprintf(fp, "%lld\n", (long long)when);
+	for (i = 0; i < n; i++) {
+		if (!getnameinfo((const struct sockaddr *)&a[i].sa, a[i].len,
+		    host, sizeof(host), NULL, 0, NI_NUMERICHOST))
+			fprintf(fp, "%s\n", host);
+	}
+	if (fclose(fp) == EOF || rename(tpath, path) == -1)
+		unlink(tpath);
+}
+
+/* resolve in a thread of its own and update the addrs file, for the next
+ * connect. the event loop never waits for the resolver. */
+static void *
+addr_refresh_run(void *arg)
+{
+	Refresh *r = arg;
+	Addr a[CONNECT_MAX];
+	int n;
+
+	if ((n = addr_resolve(r->host, r->service, a, CONNECT_MAX)) > 0)
+		addr_save(r->dir, ".addrs.bg", a, n, time(NULL));
+	if (__atomic_exchange_n(&r->state, REFRESH_IDLE, __ATOMIC_ACQ_REL) ==
+	    REFRESH_GONE)
+		free(r);
+	return NULL;
+}
+
+static void
+addr_refresh(Conn *cn)
+{
+	pthread_attr_t attr;
+	sigset_t set, old;
+	pthread_t t;
+	Refresh *r;
+
+	if (!cn->refresh) {
+		if (!(r = malloc(sizeof(*r))))
+			return;
+		r->host = cn->host;
+		r->service = cn->service;
+		strlcpy(r->dir, cn->ircpath, sizeof(r->dir));
+		r->state = REFRESH_IDLE;
+		cn->refresh = r;
+	}
+	r = cn->refresh;
+	/* one at a time per server: a resolver that hangs does not pile up
+	 * threads */
+	if (__atomic_exchange_n(&r->state, REFRESH_BUSY, __ATOMIC_ACQ_REL) ==
+	    REFRESH_BUSY)
+		return;
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	sigfillset(&set);
+	pthread_sigmask(SIG_BLOCK, &set, &old);
+	if (pthread_create(&t, &attr, addr_refresh_run, r))
+		__atomic_store_n(&r->state, REFRESH_IDLE, __ATOMIC_RELEASE);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	pthread_attr_destroy(&attr);
+}
+
+/* cn goes away: a resolver still running frees its Refresh when done */
+static void
+addr_refresh_free(Conn *cn)
+{
+	if (cn->refresh && __atomic_exchange_n(&cn->refresh->state,
+	    REFRESH_GONE, __ATOMIC_ACQ_REL) != REFRESH_BUSY)
+		free(cn->refresh);
+}
+
+/* begin trying the n addresses in a, resolved at when */
+static void
+addr_start(Conn *cn, const Addr *a, int n, time_t when)
+{
+	memcpy(cn->addrs, a, n * sizeof(*a));
+	cn->naddrs = n;
+	cn->nexta = cn->ncpfd = cn->cwon = 0;
+	cn->addrwhen = when;
+	cn->cerr = ETIMEDOUT;
+	cn->cnext = 0;
+	cn->cend = uptime_ms() + CONNECT_TIMEOUT * 1000;
+}
+
+/* stop watching the attempts in flight and close them, all but keep */
+static void
+addr_close(Conn *cn, int keep)
+{
+	int j;
+
+	for (j = 0; j < cn->ncpfd; j++) {
+		ev_del(cn->cpfd[j].fd, NULL);
+		if (cn->cpfd[j].fd != keep)
+			close(cn->cpfd[j].fd);
+	}
+	cn->ncpfd = 0;
+}
+
+/* connect to the first address that answers, RFC 8305 style: they are
+ * tried in turn, each CONNECT_STAGGER ms after the last unless that failed
+ * earlier, and the attempts run in parallel. a dead route of one family
+ * thus costs CONNECT_STAGGER ms instead of the TCP timeout. the sockets
+ * are non-blocking and watched by the event loop, this only looks at them,
+ * waiting at most timeout ms. the socket once one answered, cn->cwon is
+ * its address; -1 with cn->cerr set if none did; -2 while trying. */
+static int
+addr_step(Conn *cn, int timeout)
+{
+	struct pollfd *pfd = cn->cpfd;
+	long long now;
+	socklen_t len;
+	int fd = -1, e, flags, failed, t, i, j;
+
+	for (;;) {
+		now = uptime_ms();
+		/* the next attempt, when it is due or nothing else is
+		 * pending */
+		if ((i = cn->nexta) < cn->naddrs &&
+		    (now >= cn->cnext || !cn->ncpfd)) {
+			cn->nexta++;
+			if ((fd = socket(cn->addrs[i].sa.ss_family, SOCK_STREAM,
+			    0)) == -1) {
+				cn->cerr = errno;
+				continue;
+			}
+			if ((flags = fcntl(fd, F_GETFL)) == -1 ||
+			    fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1 ||
+			    (connect(fd, (const struct sockaddr *)&cn->addrs[i].sa,
+			             cn->addrs[i].len) == -1 && errno != EINPROGRESS) ||
+			    ev_add(fd, cn, EV_WRITE) == -1) {
+				cn->cerr = errno;
+				close(fd);
+				continue;
+			}
+			cn->cidx[cn->ncpfd] = i;
+			pfd[cn->ncpfd].fd = fd;
+			pfd[cn->ncpfd++].events = POLLOUT;
+			cn->cnext = now + CONNECT_STAGGER;
+			continue;
+		}
+		if (!cn->ncpfd || now >= cn->cend)
+			break;
+
+		t = (i < cn->naddrs ? cn->cnext : cn->cend) - now;
+		if (poll(pfd, cn->ncpfd, t < timeout ? t : timeout) == -1) {
+			if (errno == EINTR)
+				return -2;
+			cn->cerr = errno;
+			break;
+		}
+		for (j = 0, failed = 0, fd = -1; j < cn->ncpfd; ) {
+			if (!pfd[j].revents) {
+				j++;
+				continue;
+			}
+			len = sizeof(e);
+			if (getsockopt(pfd[j].fd, SOL_SOCKET, SO_ERROR, &e, &len) == -1)
+				e = errno;
+			if (!e && fd == -1) {
+				fd = pfd[j].fd;
+				cn->cwon = cn->cidx[j++];
+				continue;
+			}
+			/* failed: the next address may go right away */
+			cn->cerr = e ? e : cn->cerr;
+			ev_del(pfd[j].fd, NULL);
+			close(pfd[j].fd);
+			pfd[j] = pfd[--cn->ncpfd];
+			cn->cidx[j] = cn->cidx[cn->ncpfd];
+			cn->cnext = 0;
+			failed = 1;
+		}
+		if (fd != -1) {
+			addr_close(cn, fd);
+			return fd;
+		}
+		if (!failed)
+			return -2;
+	}
+	addr_close(cn, -1);
+	return -1;
+}
+
+/* start connecting to the server of cn. addresses resolved within ADDR_TTL
+ * are taken from the addrs file without asking the resolver, which is asked
+ * in the background instead. only at startup, when nothing else runs yet,
+ * does the connect wait for it. a reconnect without fresh addresses tries
+ * the expired ones while the resolver runs, or fails and finds its answer
+ * on the next retry. -1 if there is nothing to try. */
+static int
+tcpopen(Conn *cn)
+{
+	Addr a[CONNECT_MAX];
+	time_t when = 0;
+	int i, n;
+
+	n = addr_load(cn->ircpath, cn->service, a, CONNECT_MAX, &when);
+	if ((cn->addrcached = n > 0 && clk.tv_sec - when < ADDR_TTL)) {
+		if (clk.tv_sec - when >= ADDR_REFRESH)
+			addr_refresh(cn);
+	} else if (cn->st.nreconnect) {
+		addr_refresh(cn);
+		if (!n) {
+			fprintf(stderr, "%s: %s: no address yet, resolving\n",
+			        argv0, cn->host);
+			return -1;
+		}
+	} else if ((i = addr_resolve(cn->host, cn->service, a, CONNECT_MAX)) > 0) {
+		n = i;
+		when = clk.tv_sec;
+		addr_save(cn->ircpath, ".addrs", a, n, when);
+	} else if (!n) {
+		return -1;
+	} /* else the resolver failed: expired addresses are better than none */
+	addr_start(cn, a, n, when);
+	return 0;
+}
+
+/* carry on the connect tcpopen() started, see addr_step(). the socket, -1
+ * if it failed (printed), -2 while still trying. */
+static int
+tcpstep(Conn *cn, int timeout)
+{
+	Addr a[CONNECT_MAX], t;
+	int fd, n, won;
+
+	if ((fd = addr_step(cn, timeout)) == -2)
+		return -2;
+	if (fd == -1 && cn->addrcached) {
+		/* the server may have moved. at startup nothing else runs
+		 * yet, so ask the resolver right away */
+		cn->addrcached = 0;
+		if (!cn->st.nreconnect &&
+		    (n = addr_resolve(cn->host, cn->service, a, CONNECT_MAX)) > 0) {
+			addr_save(cn->ircpath, ".addrs", a, n, clk.tv_sec);
+			addr_start(cn, a, n, clk.tv_sec);
+			return -2;
+		}
+		addr_refresh(cn);
+	}
+	if (fd == -1) {
+		fprintf(stderr, "%s: could not connect to %s:%s: %s\n",
+			argv0, cn->host, cn->service, strerror(cn->cerr));
+		return -1;
+	}
+	/* the address that answered goes first next time */
+	if ((won = cn->cwon) > 0) {
+		t = cn->addrs[won];
+		memmove(cn->addrs + 1, cn->addrs, won * sizeof(*cn->addrs));
+		cn->addrs[0] = t;
+		addr_save(cn->ircpath, ".addrs", cn->addrs, cn->naddrs, cn->addrwhen);
+	}
+	return fd;
+}
+
+#ifdef USE_TLS
+/* the reason the TLS connection or its setup failed */
+static const char *
+tls_strerror(Conn *cn)
+{
+	unsigned long e;
+	long v;
+
+	if (cn->ssl && (v = SSL_get_verify_result(cn->ssl)) != X509_V_OK)
+		return X509_verify_cert_error_string(v);
+	if ((e = ERR_get_error()))
+		return ERR_reason_error_string(e) ? ERR_reason_error_string(e) :
+		       "unknown error";
+	return errno ? strerror(errno) : "unknown error";
+}
+
+/* speak TLS on the connection. OpenSSL does not touch the socket: the
+ * records go through a BIO pair that ii reads into and writes from, so
+ * the event loop (and io_uring receives) work unchanged. the session of
+ * the last connection, from <ircpath>/tls_session, is offered to the
+ * server to skip the full handshake. */
+static void
+tls_start(Conn *cn)
+{
+	unsigned char buf[TLS_SESSION_MAX];
+	const unsigned char *p = buf;
+	char path[PATH_MAX];
+	struct in6_addr a;
+	SSL_SESSION *sess;
+	BIO *in;
+	ssize_t n;
+	int fd;
+
+	if (!(cn->tlsctx = SSL_CTX_new(TLS_client_method())) ||
+	    !SSL_CTX_set_min_proto_version(cn->tlsctx, TLS1_2_VERSION) ||
+	    !(cn->cafile ?
+	      SSL_CTX_load_verify_locations(cn->tlsctx, cn->cafile, NULL) :
+	      SSL_CTX_set_default_verify_paths(cn->tlsctx)))
+		goto fail;
+	SSL_CTX_set_verify(cn->tlsctx, SSL_VERIFY_PEER, NULL);
+	SSL_CTX_set_mode(cn->tlsctx, SSL_MODE_ENABLE_PARTIAL_WRITE |
+	                 SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+	SSL_CTX_set_session_cache_mode(cn->tlsctx, SSL_SESS_CACHE_CLIENT |
+	                               SSL_SESS_CACHE_NO_INTERNAL_STORE);
+	SSL_CTX_sess_set_new_cb(cn->tlsctx, tls_newsession);
+
+	if (!(cn->ssl = SSL_new(cn->tlsctx)) ||
+	    !BIO_new_bio_pair(&in, TLS_BUFSIZE, &cn->tlsio, TLS_BUFSIZE))
+		goto fail;
+	SSL_set_bio(cn->ssl, in, in);
+	SSL_set_app_data(cn->ssl, cn);
+	/* no SNI for an address */
+	if (inet_pton(AF_INET, cn->host, &a) != 1 &&
+	    inet_pton(AF_INET6, cn->host, &a) != 1 &&
+	    !SSL_set_tlsext_host_name(cn->ssl, cn->host))
+		goto fail;
+	if (!SSL_set1_host(cn->ssl, cn->host))
+		goto fail;
+
+	if (snprintf(path, sizeof(path), "%s/tls_session", cn->ircpath) <
+	    (int)sizeof(path) && (fd = open(path, O_RDONLY)) != -1) {
+		if ((n = read(fd, buf, sizeof(buf))) > 0 &&
+		    (sess = d2i_SSL_SESSION(NULL, &p, n))) {
+			SSL_set_session(cn->ssl, sess);
+			SSL_SESSION_free(sess);
+		}
+		close(fd);
+	}
+
+	/* the ClientHello, sent with the login lines */
+	SSL_set_connect_state(cn->ssl);
+	SSL_do_handshake(cn->ssl);
+	return;
+fail:
+	fprintf(stderr, "%s: %s: TLS: %s\n", argv0, cn->host, tls_strerror(cn));
+	exit(1);
+}
+
+/* a session ticket from the server: keep it for the next connection. the
+ * file is replaced atomically and readable by the user only, it holds the
+ * keys of the session. */
+static int
+tls_newsession(SSL *ssl, SSL_SESSION *sess)
+{
+	Conn *cn = SSL_get_app_data(ssl);
+	unsigned char buf[TLS_SESSION_MAX], *p = buf;
+	char path[PATH_MAX], tmp[PATH_MAX];
+	int fd, len;
+
+	if (!SSL_SESSION_is_resumable(sess) ||
+	    (len = i2d_SSL_SESSION(sess, NULL)) <= 0 || len > (int)sizeof(buf))
+		return 0;
+	i2d_SSL_SESSION(sess, &p);
+	if (snprintf(path, sizeof(path), "%s/tls_session", cn->ircpath) >= (int)sizeof(path) ||
+	    snprintf(tmp, sizeof(tmp), "%s/.tls_session", cn->ircpath) >= (int)sizeof(tmp) ||
+	    (fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600)) == -1)
+		return 0;
+	if (write(fd, buf, len) == len && close(fd) == 0)
+		rename(tmp, path);
+	else
+		unlink(tmp);
+	return 0; /* not kept, the file is enough */
+}
+
+/* records from the server, read straight into the BIO pair */
+static void
+tls_read(Conn *cn)
+{
+	char *p;
+	ssize_t r;
+	int n;
+
+	if ((n = BIO_nwrite0(cn->tlsio, &p)) <= 0) {
+		tls_input(cn);
+		return;
+	}
+	if ((r = read(cn->infd, p, n)) <= 0) {
+		if (r == -1 && (errno == EINTR || errno == EAGAIN ||
+		    errno == EWOULDBLOCK))
+			return;
+		server_lost(cn, r == 0 ? 0 : errno);
+		return;
+	}
+	BIO_nwrite(cn->tlsio, &p, r);
+	cn->rb.nreads++;
+	tls_input(cn);
+}
+
+/* records io_uring received for the server (EV_DATA) */
+static void
+tls_recv(Conn *cn, const char *data, ssize_t len)
+{
+	int n;
+
+	while (len > 0) {
+		if ((n = BIO_write(cn->tlsio, data, len)) > 0) {
+			data += n;
+			len -= n;
+		}
+		/* the pair is emptied into the receive buffer, which always
+		 * has room after server_input() */
+		if (tls_input(cn) == -1)
+			return;
+	}
+}
+
+/* decrypt what arrived and dispatch the lines. this also moves the
+ * handshake on, after which the queued lines can go out. -1 if the
+ * connection is gone. */
+static int
+tls_input(Conn *cn)
+{
+	Linebuf *lb = &cn->rb;
+	int n;
+
+	while ((n = SSL_read(cn->ssl, lb->buf + lb->len,
+	                     sizeof(lb->buf) - lb->len)) > 0)
+		server_input(cn, n);
+	switch (SSL_get_error(cn->ssl, n)) {
+	case SSL_ERROR_WANT_READ:
+	case SSL_ERROR_WANT_WRITE:
+		break;
+	case SSL_ERROR_ZERO_RETURN:
+		server_lost(cn, 0);
+		return -1;
+	default:
+		fprintf(stderr, "%s: %s: TLS: %s\n", argv0, cn->host,
+		        tls_strerror(cn));
+		conn_lost(cn, 1);
+		return -1;
+	}
+	conn_flush(cn);
+	return 0;
+}
+
+/* encrypt the send queue and write the records to the socket, as long as
+ * either side takes more. the send queue only drains as fast as the BIO
+ * pair, so the high-water mark on the "in" FIFOs still works. returns the
+ * bytes of records left over. */
+static size_t
+tls_flush(Conn *cn)
+{
+	char *p;
+	size_t n;
+	ssize_t w;
+	int r;
+
+	for (;;) {
+		while (cn->sqlen > 0) {
+			n = SENDQ_SIZE - cn->sqhead;
+			if (n > cn->sqlen)
+				n = cn->sqlen;
+			/* fails until the handshake is done */
+			if ((r = SSL_write(cn->ssl, cn->sq + cn->sqhead, n)) <= 0)
+				break;
+			cn->sqhead = (cn->sqhead + r) % SENDQ_SIZE;
+			cn->sqlen -= r;
+		}
+		if ((r = BIO_nread0(cn->tlsio, &p)) <= 0)
+			break;
+		if ((w = write(cn->outfd, p, r)) == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			conn_werror(cn);
+			cn->sqlen = 0;
+			BIO_nread(cn->tlsio, &p, r);
+			break;
+		}
+		BIO_nread(cn->tlsio, &p, w);
+	}
+	if (cn->sqlen == 0)
+		cn->sqhead = 0;
+	return BIO_ctrl_pending(cn->tlsio);
+}
+#endif /* USE_TLS */
+
+/* split a line from the server into its parts. the spans point into s,
+ * which is neither copied nor modified. returns -1 if there is no command. */
+static int
+irc_parse(Ircmsg *m, const char *s, size_t len)
+{
+	const char *end = s + len, *p, *q;
+
+	memset(m, 0, sizeof(*m));
+
+	/* @tags */
+	if (s < end && *s == '@') {
+		if (!(p = memchr(s, ' ', end - s)))
+			p = end;
+		m->tags.p = s + 1;
+		m->tags.len = p - s - 1;
+		for (s = p; s < end && *s == ' '; s++)
+			;
+	}
+
+	/* :nick!user@host or :servername */
+	if (s < end && *s == ':') {
+		if (!(p = memchr(s, ' ', end - s)))
+			p = end;
+		m->nick.p = ++s;
+		if ((q = memchr(s, '!', p - s))) {
+			m->user.p = q + 1;
+			s = q;
+		}
+		if ((q = memchr(s, '@', p - s))) {
+			m->host.p = q + 1;
+			m->host.len = p - q - 1;
+		} else {
+			q = p;
+		}
+		if (m->user.p) {
+			m->nick.len = m->user.p - 1 - m->nick.p;
+			m->user.len = q - m->user.p;
+		} else {
+			m->nick.len = q - m->nick.p;
+		}
+		for (s = p; s < end && *s == ' '; s++)
+			;
+	}
+
+	if (!(p = memchr(s, ' ', end - s)))
+		p = end;
+	if (p == s)
+		return -1;
+	m->cmd.p = s;
+	m->cmd.len = p - s;
+	if (m->cmd.len == 3 && isdigit((unsigned char)s[0]) &&
+	    isdigit((unsigned char)s[1]) && isdigit((unsigned char)s[2]))
+		m->num = (s[0] - '0') * 100 + (s[1] - '0') * 10 + (s[2] - '0');
+
+	/* middle parameters, then the trailing one. the last possible
+	 * parameter takes the rest of the line, with or without ':'. */
+	for (s = p; m->nparams < IRC_PARAMS_MAX; s = p) {
+		for (; s < end && *s == ' '; s++)
+			;
+		if (s == end)
+			break;
+		if (*s == ':' || m->nparams == IRC_PARAMS_MAX - 1) {
+			if (*s == ':')
+				s++;
+			p = end;
+		} else if (!(p = memchr(s, ' ', end - s))) {
+			p = end;
+		}
+		m->params[m->nparams].p = s;
+		m->params[m->nparams++].len = p - s;
+	}
+	return 0;
+}
+
+/* parameter i, or an empty span if there are fewer */
+static Span
+irc_param(const Ircmsg *m, size_t i)
+{
+	Span none = { NULL, 0 };
+
+	return i < m->nparams ? m->params[i] : none;
+}
+
+/* user@host of the sender, an empty span for server lines */
+static Span
+irc_userhost(const Ircmsg *m)
+{
+	Span s = m->user;
+
+	if (s.p && m->host.p)
+		s.len = m->host.p + m->host.len - s.p;
+	return s;
+}
+
+/* parameters from i on, separated by single spaces */
+static void
+irc_params_join(const Ircmsg *m, size_t i, char *buf, size_t size)
+{
+	size_t len = 0;
+	int r;
+
+	buf[0] = '\0';
+	for (; i < m->nparams && len < size; i++) {
+		r = snprintf(buf + len, size - len, "%s%.*s",
+		             len ? " " : "", SPAN(m->params[i]));
+		if (r < 0)
+			break;
+		len += r;
+	}
+}
+
+static int
+span_eq(Span s, const char *str)
+{
+	return s.p && strlen(str) == s.len && !memcmp(s.p, str, s.len);
+}
+
+/* copy of s as a string, for the lookup functions. truncated to size. */
+static char *
+span_str(Span s, char *buf, size_t size)
+{
+	size_t len = s.len < size - 1 ? s.len : size - 1;
+
+	if (len)
+		memcpy(buf, s.p, len);
+	buf[len] = '\0';
+	return buf;
+}
+
+static void
+out_close(Outfile *of)
+{
+	if (of->fd == -1)
+		return;
+	if (noutpend)
+		out_flush(); /* lines may be held back for of->fd */
+	if (of->dirty) {
+		/* with -S a closed file is as durable as an open one */
+		fdatasync(of->fd);
+		__atomic_fetch_add(&outsyncs, 1, __ATOMIC_RELAXED);
+		of->dirty = 0;
+		noutdirty--;
+	}
+	close(of->fd);
+	of->fd = -1;
+	if (of->idxfd != -1)
+		close(of->idxfd);
+	of->idxfd = -1;
+	__atomic_fetch_sub(&noutfds, 1, __ATOMIC_RELAXED);
+
+	if (of->lruprev)
+		of->lruprev->lrunext = of->lrunext;
+	else
+		outlru = of->lrunext;
+	if (of->lrunext)
+		of->lrunext->lruprev = of->lruprev;
+	else
+		outlrutail = of->lruprev;
+	of->lruprev = of->lrunext = NULL;
+}
+
+/* make sure of->fd is open and points at "out" in its directory. it is checked at
+ * most once a second so a log that was moved away (e.g. by logrotate) gets
+ * reopened without a stat(2) for every line. */
+static int
+out_open(Outfile *of, time_t now)
+{
+	char out[PATH_MAX], idx[PATH_MAX];
+	struct stat st;
+	int fd;
+
+	out_relpath(of, "out", out, sizeof(out));
+	if (of->fd != -1 && of->checked != now) {
+		of->checked = now;
+		if (fstatat(of->dir->fd, out, &st, 0) == -1 || st.st_dev != of->dev ||
+		    st.st_ino != of->ino)
+			out_close(of);
+	}
+
+	if (of->fd != -1) {
+		if (outlru == of)
+			return 0;
+		/* move to the front of the LRU list */
+		of->lruprev->lrunext = of->lrunext;
+		if (of->lrunext)
+			of->lrunext->lruprev = of->lruprev;
+		else
+			outlrutail = of->lruprev;
+		of->lruprev = NULL;
+		of->lrunext = outlru;
+		outlru->lruprev = of;
+		outlru = of;
+		return 0;
+	}
+
+	if (noutfds >= OUTFD_MAX && outlrutail)
+		out_close(outlrutail);
+	if ((fd = openat(of->dir->fd, out, O_WRONLY | O_APPEND | O_CREAT, 0666)) == -1)
+		return -1;
+	if (fstat(fd, &st) == -1) {
+		close(fd);
+		return -1;
+	}
+	of->fd = fd;
+	/* the index is started over when out is new or was replaced */
+	of->idxfd = openat(of->dir->fd, out_relpath(of, "out.idx", idx, sizeof(idx)),
+	                   O_WRONLY | O_APPEND | O_CREAT | (st.st_size ? 0 : O_TRUNC),
+	                   0666);
+	of->dev = st.st_dev;
+	of->ino = st.st_ino;
+	of->checked = now;
+	of->size = st.st_size;
+	of->day = (st.st_size ? st.st_mtime : now) / DAY;
+	of->idxlines = IDX_LINES; /* the first line written gets an entry */
+	__atomic_fetch_add(&noutfds, 1, __ATOMIC_RELAXED);
+
+	of->lruprev = NULL;
+	of->lrunext = outlru;
+	if (outlru)
+		outlru->lruprev = of;
+	else
+		outlrutail = of;
+	outlru = of;
+	return 0;
+}
+
+/* a directory stream of dirfd, which stays open for the *at() calls */
+static DIR *
+dir_open(int dirfd)
+{
+	DIR *dp;
+	int fd;
+
+	if ((fd = openat(dirfd, ".", O_RDONLY | O_DIRECTORY)) == -1)
+		return NULL;
+	if (!(dp = fdopendir(fd)))
+		close(fd);
+	return dp;
+}
+
+/* let go of dir, closing it if nobody else uses it */
+static void
+dir_release(Dir *dir)
+{
+	if (__atomic_sub_fetch(&dir->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+		close(dir->fd);
+		free(dir);
+	}
+}
+
+/* file of the channel directory of of, relative to the server directory */
+static const char *
+out_relpath(const Outfile *of, const char *file, char *buf, size_t size)
+{
+	snprintf(buf, size, "%s%s%s", of->sub, of->sub[0] ? "/" : "", file);
+	return buf;
+}
+
+/* remove the oldest segments in dirfd until at most outkeep are left.
+ * segments are "out." followed by a digit and ordered by modification
+ * time, which is when they were rolled. */
+static void
+out_prune(int dirfd)
+{
+	struct { time_t mtime; char name[64]; } *segs = NULL, *tmp;
+	char path[PATH_MAX], *p;
+	struct dirent *de;
+	struct stat st;
+	size_t nsegs = 0, cap = 0, i, old;
+	DIR *dp;
+
+	if (!(dp = dir_open(dirfd)))
+		return;
+	while ((de = readdir(dp))) {
+		if (strncmp(de->d_name, "out.", 4) || !isdigit((unsigned char)de->d_name[4]) ||
+		    strlen(de->d_name) >= sizeof(segs->name) ||
+		    ((p = strrchr(de->d_name, '.')) && !strcmp(p, ".idx")))
+			continue;
+		if (fstatat(dirfd, de->d_name, &st, 0) == -1)
+			continue;
+		if (nsegs == cap) {
+			cap = cap ? cap * 2 : 16;
+			if (!(tmp = realloc(segs, cap * sizeof(*segs))))
+				break;
+			segs = tmp;
+		}
+		segs[nsegs].mtime = st.st_mtime;
+		strlcpy(segs[nsegs].name, de->d_name, sizeof(segs->name));
+		nsegs++;
+	}
+	closedir(dp);
+
+	for (; nsegs > (size_t)outkeep; nsegs--) {
+		/* oldest first; segments rolled within the same second are
+		 * told apart by their number, out.9 before out.10 */
+		for (old = 0, i = 1; i < nsegs; i++) {
+			if (segs[i].mtime != segs[old].mtime ?
+			    segs[i].mtime < segs[old].mtime :
+			    strlen(segs[i].name) != strlen(segs[old].name) ?
+			    strlen(segs[i].name) < strlen(segs[old].name) :
+			    strcmp(segs[i].name, segs[old].name) < 0)
+				old = i;
+		}
+		unlinkat(dirfd, segs[old].name, 0);
+		snprintf(path, sizeof(path), "%s.idx", segs[old].name);
+		unlinkat(dirfd, path, 0);
+		segs[old] = segs[nsegs - 1];
+	}
+	free(segs);
+}
+
+/* move the "out" file of aside as a finished segment and let the next
+ * write start a new one. segments are named out.<N>, one above the highest
+ * N so far; with -d out.<YYYY-MM-DD> after the day of their last line, or
+ * out.<YYYY-MM-DD>.<N> if that day was already rolled for its size. the
+ * index goes along as <segment>.idx. */
+static void
+out_roll(Outfile *of)
+{
+	char stem[32], name[64], idx[sizeof(name) + 4];
+	char *p, *end;
+	struct dirent *de;
+	struct tm tm;
+	time_t day;
+	size_t stemlen;
+	unsigned long n, max = 0;
+	int dirfd, exists = 0;
+	DIR *dp;
+
+	out_close(of);
+	if (outdaily) {
+		day = (time_t)of->day * DAY;
+		gmtime_r(&day, &tm);
+		strftime(stem, sizeof(stem), "out.%Y-%m-%d", &tm);
+	} else {
+		strlcpy(stem, "out", sizeof(stem));
+	}
+	stemlen = strlen(stem);
+
+	/* the channel directory, only while rolling */
+	if ((dirfd = openat(of->dir->fd, of->sub[0] ? of->sub : ".",
+	    O_RDONLY | O_DIRECTORY)) == -1)
+		return;
+	if (!(dp = dir_open(dirfd))) {
+		close(dirfd);
+		return;
+	}
+	while ((de = readdir(dp))) {
+		if (strncmp(de->d_name, stem, stemlen))
+			continue;
+		p = de->d_name + stemlen;
+		if (*p == '\0') {
+			exists = 1;
+		} else if (*p == '.' && isdigit((unsigned char)p[1])) {
+			n = strtoul(p + 1, &end, 10);
+			if (!*end && n > max)
+				max = n;
+		}
+	}
+	closedir(dp);
+
+	if (outdaily && !exists)
+		snprintf(name, sizeof(name), "%s", stem);
+	else
+		snprintf(name, sizeof(name), "%s.%lu", stem, max + 1);
+	if (renameat(dirfd, "out", dirfd, name) == -1) {
+		fprintf(stderr, "%s: %s: cannot roll to %s: %s\n", argv0,
+		        of->path, name, strerror(errno));
+		close(dirfd);
+		return;
+	}
+	__atomic_fetch_add(&outrolls, 1, __ATOMIC_RELAXED);
+	snprintf(idx, sizeof(idx), "%s.idx", name);
+	renameat(dirfd, "out.idx", dirfd, idx);
+	if (outkeep)
+		out_prune(dirfd);
+	close(dirfd);
+}
+
+/* append an entry for the line about to be written to "out.idx" */
+static void
+out_idxadd(Outfile *of, time_t now)
+{
+	Idx e;
+
+	of->idxlines = 0;
+	of->idxlast = now;
+	if (of->idxfd == -1)
+		return;
+	e.sec = now;
+	e.off = of->size;
+	write(of->idxfd, &e, sizeof(e));
+}
+
+
+/* write n iovecs to fd, less the first skip bytes. stdout may be a pipe
+ * and take only part of them, so go on until all are written. */
+static void
+out_writev(int fd, struct iovec *v, int n, size_t skip)
+{
+	ssize_t w = skip;
+
+	for (;;) {
+		for (; n > 0 && (size_t)w >= v->iov_len; v++, n--)
+			w -= v->iov_len;
+		if (n == 0)
+			return;
+		v->iov_base = (char *)v->iov_base + w;
+		v->iov_len -= w;
+		while ((w = writev(fd, v, n < OUTIOV_MAX ? n : OUTIOV_MAX)) == -1) {
+			if (errno != EINTR)
+				return;
+		}
+	}
+}
+
+/* write the lines held back, with the lines of each file in the order they
+ * were queued: one writev(2) per file or, with io_uring, one submission
+ * for all of them. */
+static void
+out_flush(void)
+{
+	struct iovec iov[OUTPEND_MAX];
+	struct { int fd, start, n; size_t len; } grp[OUTPEND_MAX];
+	int fd, i, j, n, ngrp = 0;
+#ifdef USE_IOURING
+	struct io_uring_sqe *sqe;
+	struct io_uring_cqe *cqe;
+	unsigned head, tail;
+	int got, k;
+#endif
+
+	for (i = n = 0; i < noutpend; i++) {
+		if ((fd = outpend[i].fd) == -1)
+			continue;
+		grp[ngrp].fd = fd;
+		grp[ngrp].start = n;
+		grp[ngrp].len = 0;
+		for (j = i; j < noutpend; j++) {
+			if (outpend[j].fd == fd) {
+				grp[ngrp].len += outpend[j].iov.iov_len;
+				iov[n++] = outpend[j].iov;
+				outpend[j].fd = -1;
+			}
+		}
+		grp[ngrp].n = n - grp[ngrp].start;
+		ngrp++;
+	}
+	noutpend = 0;
+
+#ifdef USE_IOURING
+	for (i = 0; wur.fd != -1 && i < ngrp; i += k) {
+		k = ngrp - i < WUR_ENTRIES ? ngrp - i : WUR_ENTRIES;
+		for (j = i; j < i + k; j++) {
+			sqe = uring_sqe(&wur);
+			sqe->opcode = IORING_OP_WRITEV;
+			sqe->fd = grp[j].fd;
+			sqe->addr = (unsigned long)(iov + grp[j].start);
+			sqe->len = grp[j].n; /* <= OUTPEND_MAX < IOV_MAX */
+			sqe->off = -1;       /* append */
+			sqe->user_data = j;
+		}
+		uring_enter(&wur, k, -1);
+		for (got = 0; got < k; ) {
+			head = *wur.cqhead;
+			tail = __atomic_load_n(wur.cqtail, __ATOMIC_ACQUIRE);
+			if (head == tail) {
+				uring_enter(&wur, 1, -1);
+				continue;
+			}
+			for (; head != tail; head++, got++) {
+				cqe = &wur.cqes[head & *wur.cqmask];
+				j = cqe->user_data;
+				/* short write, e.g. to a pipe: the rest the slow way */
+				if ((cqe->res >= 0 && (size_t)cqe->res < grp[j].len) ||
+				    cqe->res == -EAGAIN || cqe->res == -EINTR)
+					out_writev(grp[j].fd, iov + grp[j].start,
+					           grp[j].n, cqe->res > 0 ? cqe->res : 0);
+			}
+			__atomic_store_n(wur.cqhead, head, __ATOMIC_RELEASE);
+		}
+	}
+	if (wur.fd != -1)
+		return;
+#endif
+	for (i = 0; i < ngrp; i++)
+		out_writev(grp[i].fd, iov + grp[i].start, grp[i].n, 0);
+}
+
+/* fdatasync(2) the out files written to since the last call (-S). the
+ * index files are left alone: iilog copes with a stale one. with io_uring
+ * the syncs of all files are submitted at once and run in parallel. */
+static void
+out_sync(void)
+{
+	Outfile *of;
+#ifdef USE_IOURING
+	struct io_uring_sqe *sqe;
+	unsigned head, tail;
+	int n = 0;
+#endif
+
+	if (noutpend)
+		out_flush();
+#ifdef USE_IOURING
+	if (wur.fd != -1 && noutdirty) {
+		for (of = outlru; of; of = of->lrunext) {
+			if (!of->dirty)
+				continue;
+			sqe = uring_sqe(&wur);
+			sqe->opcode = IORING_OP_FSYNC;
+			sqe->fd = of->fd;
+			sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+			of->dirty = 0;
+			n++;
+		}
+		uring_enter(&wur, n, -1);
+		while (n > 0) {
+			head = *wur.cqhead;
+			tail = __atomic_load_n(wur.cqtail, __ATOMIC_ACQUIRE);
+			if (head == tail) {
+				uring_enter(&wur, 1, -1);
+				continue;
+			}
+			n -= tail - head;
+			__atomic_store_n(wur.cqhead, tail, __ATOMIC_RELEASE);
+		}
+	}
+#endif
+	for (of = outlru; of; of = of->lrunext) {
+		if (of->dirty) {
+			fdatasync(of->fd);
+			of->dirty = 0;
+		}
+	}
+	__atomic_fetch_add(&outsyncs, noutdirty, __ATOMIC_RELAXED);
+	noutdirty = 0;
+}
+
+/* append the line of r to its out file, or to stdout if it has none. the
+ * line is held back until out_flush(), which batches the lines per file. */
+static void
+out_line(Outrec *r)
+{
+	Outfile *of = r->of;
+	int fd;
+
+	if (of) {
+		if (out_open(of, r->sec) == -1)
+			return;
+		if (of->size && ((outmax && of->size + (off_t)r->len > outmax) ||
+		    (outdaily && r->sec / DAY != of->day))) {
+			out_roll(of);
+			if (out_open(of, r->sec) == -1)
+				return;
+		}
+		if (++of->idxlines >= IDX_LINES || r->sec - of->idxlast >= IDX_SECS)
+			out_idxadd(of, r->sec);
+		of->size += r->len;
+		of->day = r->sec / DAY;
+		if (outsync >= 0 && !of->dirty) {
+			of->dirty = 1;
+			noutdirty++;
+		}
+		fd = of->fd;
+	} else {
+		fd = STDOUT_FILENO;
+	}
+	if (noutpend == OUTPEND_MAX)
+		out_flush();
+	outpend[noutpend].fd = fd;
+	outpend[noutpend].iov.iov_base = r + 1;
+	outpend[noutpend].iov.iov_len = r->len;
+	noutpend++;
+}
+
+/* room for a record with len bytes of data at outqnext, wrapping around to
+ * the start of outq if it does not fit before the end. if the writer is
+ * behind, wait for it unless -W drop is set and the record may be dropped;
+ * NULL then. */
+static char *
+outq_reserve(size_t len, int mustwait)
+{
+	struct timespec ts = { 0, 1000000 };
+	size_t pos, skip;
+	Outrec *r;
+
+	pos = outqnext % OUTQ_SIZE;
+	skip = OUTQ_SIZE - pos < OUTREC_SIZE(len) ? OUTQ_SIZE - pos : 0;
+	while (OUTQ_SIZE - (outqnext - __atomic_load_n(&outqtail, __ATOMIC_ACQUIRE)) <
+	       skip + OUTREC_SIZE(len)) {
+		if (outdrop && !mustwait)
+			return NULL;
+		outq_publish();
+		nanosleep(&ts, NULL);
+	}
+	if (skip) {
+		/* too short for a header: the writer skips it all the same */
+		if (skip >= sizeof(Outrec)) {
+			r = (Outrec *)(outq + pos);
+			r->op = OUT_PAD;
+		}
+		outqnext += skip;
+		pos = 0;
+	}
+	return outq + pos + sizeof(Outrec);
+}
+
+/* queue the record whose data outq_reserve() returned. the writer sees it
+ * after the next outq_publish(). */
+static void
+outq_commit(Outfile *of, int op, size_t len)
+{
+	Outrec *r = (Outrec *)(outq + outqnext % OUTQ_SIZE);
+
+	r->of = of;
+	r->op = op;
+	r->sec = clk.tv_sec;
+	r->len = len;
+	outqnext += OUTREC_SIZE(len);
+}
+
+/* queue a record without data: OUT_CLOSE, OUT_REOPEN, OUT_STOP */
+static void
+outq_ctl(Outfile *of, int op)
+{
+	outq_reserve(0, 1);
+	outq_commit(of, op, 0);
+}
+
+/* hand the records queued so far to the writer and wake it if it sleeps.
+ * run() calls this once per event loop iteration. */
+static void
+outq_publish(void)
+{
+	if (outqnext == outqhead)
+		return;
+	__atomic_store_n(&outqhead, outqnext, __ATOMIC_SEQ_CST);
+	if (__atomic_exchange_n(&outqsleep, 0, __ATOMIC_SEQ_CST))
+		write(outqwake[1], "", 1);
+}
+
+/* the writer thread: apply the records between outqtail and outqhead, then
+ * hand the space back to the event loop. */
+static void *
+writer_run(void *arg)
+{
+	struct pollfd pfd;
+	size_t head, tail = 0, pos;
+	long long synced = uptime_ms(), wait;
+	char buf[64];
+	Outrec *r;
+
+	(void)arg;
+	pfd.fd = outqwake[0];
+	pfd.events = POLLIN;
+#ifdef USE_IOURING
+	uring_init(&wur, WUR_ENTRIES); /* else plain writev(2) */
+#endif
+	for (;;) {
+		head = __atomic_load_n(&outqhead, __ATOMIC_ACQUIRE);
+		if (head == tail) {
+			/* outq_publish() stores outqhead before it looks at
+			 * outqsleep, so one of us sees the other */
+			__atomic_store_n(&outqsleep, 1, __ATOMIC_SEQ_CST);
+			if (__atomic_load_n(&outqhead, __ATOMIC_SEQ_CST) == tail) {
+				/* -S <ms>: wake up when the next sync is due */
+				wait = -1;
+				if (outsync > 0 && noutdirty) {
+					wait = synced + outsync - uptime_ms();
+					wait = wait < 0 ? 0 : wait;
+				}
+				if (poll(&pfd, 1, wait) > 0)
+					read(outqwake[0], buf, sizeof(buf));
+			}
+			__atomic_store_n(&outqsleep, 0, __ATOMIC_SEQ_CST);
+			if (noutdirty && uptime_ms() - synced >= outsync) {
+				out_sync();
+				synced = uptime_ms();
+			}
+			continue;
+		}
+		while (tail != head) {
+			pos = tail % OUTQ_SIZE;
+			r = (Outrec *)(outq + pos);
+			if (OUTQ_SIZE - pos < sizeof(Outrec) || r->op == OUT_PAD) {
+				tail += OUTQ_SIZE - pos;
+				continue;
+			}
+			tail += OUTREC_SIZE(r->len);
+			switch (r->op) {
+			case OUT_LINE:
+				out_line(r);
+				break;
+			case OUT_CLOSE:
+				out_close(r->of);
+				dir_release(r->of->dir);
+				free(r->of);
+				break;
+			case OUT_REOPEN:
+				/* reopened lazily on the next write */
+				while (outlru)
+					out_close(outlru);
+				break;
+			case OUT_STOP:
+				out_sync();
+				__atomic_store_n(&outqtail, tail, __ATOMIC_RELEASE);
+				return NULL;
+			}
+		}
+		out_flush();
+		__atomic_store_n(&outqtail, tail, __ATOMIC_RELEASE);
+		/* the batch is written: one sync for all of it, or after
+		 * outsync ms */
+		if (noutdirty && uptime_ms() - synced >= outsync) {
+			out_sync();
+			synced = uptime_ms();
+		}
+	}
+}
+
+static void
+writer_start(void)
+{
+	sigset_t set, old;
+	int r;
+
+	if (!(outq = malloc(OUTQ_SIZE))) {
+		fprintf(stderr, "%s: malloc: %s\n", argv0, strerror(errno));
+		exit(1);
+	}
+	if (pipe(outqwake) == -1) {
+		fprintf(stderr, "%s: pipe: %s\n", argv0, strerror(errno));
+		exit(1);
+	}
+	/* signals are for the event loop */
+	sigfillset(&set);
+	pthread_sigmask(SIG_BLOCK, &set, &old);
+	r = pthread_create(&writer, NULL, writer_run, NULL);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (r) {
+		fprintf(stderr, "%s: pthread_create: %s\n", argv0, strerror(r));
 		exit(1);
 	}
-
-	freeaddrinfo(res);
-	return fd;
+	atexit(writer_stop);
 }
 
+/* let the writer finish the queue and wait for it */
 static void
-tokenize(char **result, char *str)
+writer_stop(void)
 {
-	char delim = ' ';
-	char *p = NULL, *n = NULL;
-	size_t i = 0;
-	size_t reslen = TOK_LAST - TOK_CMD;
-	size_t argoffset = TOK_ARG - TOK_CMD;
-	size_t textoffset = TOK_TEXT - TOK_CMD;
-
-	/* find the start of the command */
-	for (n = str; *n == ' '; n++);
-
-	p = n;
-	while (*n != '\0') {
-		if (i >= reslen) {
-			return;
-		} else if (i > argoffset && *n == delim && result[0]
-		   && strtol(result[0], NULL, 10) > 0) {
-			/* numeric command message, don't process any further */
-			result[i++] = p;
-			return;
-		} else if (i < textoffset && *n == delim) {
-			*n = '\0';
-			result[i++] = p;
-			p = ++n;
-
-			if (*n == ':' && *(n+1) != '\0') {
-				/* colon indicates start of command text */
-				*n = '\0';
-				result[textoffset] = n + 1;
-				return;
-			}
-		} else {
-			n++;
-		}
-	}
+	static int stopped;
 
-	/* add last entry */
-	if (i < reslen && p < n && p && *p)
-		result[i++] = p;
-
-	return;
+	if (stopped++)
+		return;
+	outq_ctl(NULL, OUT_STOP);
+	outq_publish();
+	pthread_join(writer, NULL);
 }
 
 static void
 channel_print(Channel *c, const char *buf)
 {
-	FILE *fp = NULL;
-	time_t t = time(NULL);
-
-	if (!(fp = fopen(c->outpath, "a")))
+	const char *ts;
+	char *line;
+	size_t len, tslen;
+
+	ts = timestamp(&tslen);
+	len = strlen(buf);
+	if (tslen + len + 1 >= IRC_MSG_MAX + 32)
+		len = IRC_MSG_MAX + 32 - tslen - 2;
+	if (!(line = outq_reserve(tslen + len + 1, 0))) {
+		c->cn->st.ndrop++;
 		return;
-	fprintf(fp, "%lu %s\n", (unsigned long)t, buf);
-	fclose(fp);
+	}
+	memcpy(line, ts, tslen);
+	memcpy(line + tslen, buf, len);
+	len += tslen;
+	line[len++] = '\n';
+	outq_commit(c->out, OUT_LINE, len);
+	c->cn->st.nprint++;
+	c->cn->st.printbytes += len;
 }
 
 static void
-cap_parse(char *buf) {
-        char *p;
-
-        p = strtok(buf, " ");
-        
-        while (p != NULL) {
-                if (!strncmp("PREFIX=", p, 7)) {
-                        p += 7;
-                        parse_prefix(p);
-                } else if (!strncmp("CHANMODES=", p, 10)) {
-                        p += 10;
-                        parse_cmodes(p);
-                }
-
-                p = strtok(NULL, " ");
+cap_parse(Conn *cn, const Ircmsg *m) {
+        char buf[IRC_MSG_MAX];
+        size_t i;
+
+        /* 005 <nick> <token>... :are supported by this server */
+        for (i = 1; i < m->nparams; i++) {
+                span_str(m->params[i], buf, sizeof(buf));
+                if (!strncmp("PREFIX=", buf, 7))
+                        parse_prefix(cn, buf + 7);
+                else if (!strncmp("CHANMODES=", buf, 10))
+                        parse_cmodes(cn, buf + 10);
         }
 }
 
 static void
-parse_prefix(char *buf) {
-        char *m, *p;
+parse_prefix(Conn *cn, const char *buf) {
+        const char *m, *p;
         size_t l, s;
         int i;
 
@@ -761,17 +3832,17 @@ parse_prefix(char *buf) {
         if (l < 2 || *m != '(' || p == NULL || (p - m) * 2 != l)
                 return;
 
-        s = sizeof(upref);
+        s = sizeof(cn->upref);
 
         for (i=0, m++, p++; *m != ')' && i != (s - 1); m++, p++, i++) {
-                umodes[i] = *m;
-                upref[i] = *p;
+                cn->umodes[i] = *m;
+                cn->upref[i] = *p;
         }
 }
 
 static void
-parse_cmodes(char *buf) {
-        char *p;
+parse_cmodes(Conn *cn, const char *buf) {
+        const char *p;
         int n = 0;
 
         /* validate the channel modes */
@@ -784,27 +3855,27 @@ parse_cmodes(char *buf) {
         if (n < 3)
                 return;
 
-        strlcpy(cmodes, buf, sizeof(cmodes));
+        strlcpy(cn->cmodes, buf, sizeof(cn->cmodes));
 }
 
 
 static void
-proc_channels_privmsg(int ircfd, Channel *c, char *buf)
+proc_channels_privmsg(Conn *cn, Channel *c, char *buf)
 {
         Nick *n = NULL;
 
         if (trackprefix)
-                n = name_find(c, nick);
+                n = name_find(c, cn->nick);
 
         snprintf(msg, sizeof(msg), "<%s%s> %s",
-                 n ? &n->prefix : "", nick, buf);
+                 n ? &n->prefix : "", cn->nick, buf);
 	channel_print(c, msg);
 	snprintf(msg, sizeof(msg), "PRIVMSG %s :%s\r\n", c->name, buf);
-	ewritestr(ircfd, msg);
+	sched_push(cn, c, msg);
 }
 
 static void
-proc_channels_input(int ircfd, Channel *c, char *buf)
+proc_channels_input(Conn *cn, Channel *c, char *buf)
 {
         Channel * tmp;
         char *p = NULL;
@@ -813,7 +3884,7 @@ proc_channels_input(int ircfd, Channel *c, char *buf)
 	if (buf[0] == '\0')
 		return;
 	if (buf[0] != '/') {
-		proc_channels_privmsg(ircfd, c, buf);
+		proc_channels_privmsg(cn, c, buf);
 		return;
 	}
 
@@ -835,12 +3906,12 @@ proc_channels_input(int ircfd, Channel *c, char *buf)
 					snprintf(msg, sizeof(msg), "JOIN %s %s\r\n", &buf[3], p + 1);
 				else
 					snprintf(msg, sizeof(msg), "JOIN %s\r\n", &buf[3]);
-				channel_join(&buf[3]);
+				channel_join(cn, &buf[3]);
 			} else if (buflen >= 3) {
-                                c = channel_join(&buf[3]);
+                                c = channel_join(cn, &buf[3]);
 
                                 if (p)
-                                        proc_channels_privmsg(ircfd, c, p + 1);
+                                        proc_channels_privmsg(cn, c, p + 1);
                                 
 				return;
                         }
@@ -851,7 +3922,7 @@ proc_channels_input(int ircfd, Channel *c, char *buf)
 			break;
 		case 'a': /* away */
 			if (buflen >= 3) {
-				snprintf(msg, sizeof(msg), "-!- %s is away \"%s\"", nick, &buf[3]);
+				snprintf(msg, sizeof(msg), "-!- %s is away \"%s\"", cn->nick, &buf[3]);
 				channel_print(c, msg);
 			}
 			if (buflen >= 3)
@@ -861,12 +3932,13 @@ proc_channels_input(int ircfd, Channel *c, char *buf)
 			break;
 		case 'n': /* change nick */
 			if (buflen >= 3) {
-				strlcpy(_nick, &buf[3], sizeof(_nick));
+				strlcpy(cn->_nick, &buf[3], sizeof(cn->_nick));
 				snprintf(msg, sizeof(msg), "NICK %s\r\n", &buf[3]);
+				sched_push(cn, NULL, msg);
 			}
-			break;
+			return;
 		case 'l': /* leave */
-			if (c == channelmaster)
+			if (c == cn->channelmaster)
 				return;
 			if (buflen >= 3)
 				snprintf(msg, sizeof(msg), "PART %s :%s\r\n", c->name, &buf[3]);
@@ -875,7 +3947,7 @@ proc_channels_input(int ircfd, Channel *c, char *buf)
                                          "PART %s :leaving\r\n", c->name);
                         if ((c->name[0] == '#') || (c->name[0] == '&') ||
                             (c->name[0] == '+') || (c->name[0] == '!')) {
-                                    ewritestr(ircfd, msg);
+                                    sched_push(cn, c, msg);
                                     if (buflen >= 3) {
                                             snprintf(msg, sizeof(msg),
                                                      "-!- Leaving %s: \"%s\"",
@@ -891,7 +3963,7 @@ proc_channels_input(int ircfd, Channel *c, char *buf)
 			return;
                         break;
                 case 'o': /* notice */
-                        if (c == channelmaster)
+                        if (c == cn->channelmaster)
                                 return;
 			if (buflen >= 3) {
 				snprintf(msg, sizeof(msg), "-!- -> \"%s\"", &buf[3]);
@@ -900,13 +3972,21 @@ proc_channels_input(int ircfd, Channel *c, char *buf)
 			if (buflen >= 3)
 				snprintf(msg, sizeof(msg), "NOTICE %s :%s\r\n", c->name, &buf[3]);
 			break;
+		case 's': /* stats */
+			if (stats_write(cn) == 0)
+				snprintf(msg, sizeof(msg), "-!- stats written");
+			else
+				snprintf(msg, sizeof(msg), "-!- cannot write stats: %s",
+				         strerror(errno));
+			channel_print(c, msg);
+			return;
 		case 'q': /* quit */
 			if (buflen >= 3)
 				snprintf(msg, sizeof(msg), "QUIT :%s\r\n", &buf[3]);
 			else
 				snprintf(msg, sizeof(msg),
 				         "QUIT %s\r\n", "bye");
-                        ewritestr(ircfd, msg);
+                        sched_push(cn, NULL, msg);
 
 			if (buflen >= 3)
                                 snprintf(msg, sizeof(msg), "-!- Quitting: %s", &buf[3]);
@@ -914,12 +3994,12 @@ proc_channels_input(int ircfd, Channel *c, char *buf)
 				snprintf(msg, sizeof(msg),
                                          "-!- Quitting: %s", "bye");
 
-                        for (c = channels; c; c = tmp) {
+                        for (c = cn->channels; c; c = tmp) {
                                 tmp = c->next;
                                 channel_print(c, msg);
                         }
                         
-			isrunning = 0;
+			cn->running = 0;
 			return;
 			break;
 		default: /* raw IRC command */
@@ -931,212 +4011,359 @@ proc_channels_input(int ircfd, Channel *c, char *buf)
 		snprintf(msg, sizeof(msg), "%s\r\n", &buf[1]);
 	}
 	if (msg[0] != '\0')
-		ewritestr(ircfd, msg);
+		sched_push(cn, c, msg);
 }
 
+/* print msg to the channel a server line is about: the sender for lines
+ * addressed to us, the master channel for lines without a channel */
 static void
-proc_server_cmd(int fd, char *buf)
+server_print(Conn *cn, const Ircmsg *m)
 {
 	Channel *c;
-	const char *channel;
-	char *argv[TOK_LAST], *cmd = NULL, *p = NULL, *q = NULL;
-        unsigned int i;
-        int isnotice = 0, isprivmsg = 0;
+	char chan[IRC_CHANNEL_MAX];
+	Span channel = irc_param(m, 0);
+
+	if (span_eq(channel, cn->nick))
+		channel = m->nick;
+	if (!channel.len)
+		c = cn->channelmaster;
+	else
+		c = channel_join(cn, span_str(channel, chan, sizeof(chan)));
+	if (c)
+		channel_print(c, msg);
+}
+
+static void
+cmd_ping(Conn *cn, const Ircmsg *m)
+{
+	snprintf(msg, sizeof(msg), "PONG %.*s\r\n", SPAN(irc_param(m, 0)));
+	sched_push(cn, NULL, msg);
+}
+
+static void
+cmd_pong(Conn *cn, const Ircmsg *m)
+{
+	(void)cn;
+	(void)m;
+}
+
+/* 353 <nick> [=*@] <channel> :<names> */
+static void
+cmd_names(Conn *cn, const Ircmsg *m)
+{
+	Span chan, names, type = { NULL, 0 };
 
-	if (!buf || buf[0] == '\0')
+	if (m->nparams < 3)
 		return;
+	if (m->nparams > 3)
+		type = m->params[1];
+	chan = m->params[m->nparams - 2];
+	names = m->params[m->nparams - 1];
+
+	snprintf(msg, sizeof(msg), "%.*s%.*s %.*s",
+		 SPAN(type), SPAN(chan), SPAN(names));
+	channel_print(cn->channelmaster, msg);
+	proc_names(cn, chan, names);
+}
 
-	/* clear tokens */
-	for (i = 0; i < TOK_LAST; i++)
-		argv[i] = NULL;
+static void
+cmd_isupport(Conn *cn, const Ircmsg *m)
+{
+	irc_params_join(m, 1, msg, sizeof(msg));
+	channel_print(cn->channelmaster, msg);
+        cap_parse(cn, m);
+}
 
-	/* check prefix */
-	if (buf[0] == ':') {
-		if (!(p = strchr(buf, ' ')))
-			return;
-		*p = '\0';
-		for (++p; *p == ' '; p++)
-			;
-		cmd = p;
-		argv[TOK_NICKSRV] = &buf[1];
-		if ((p = strchr(buf, '!'))) {
-			*p = '\0';
-			argv[TOK_USER] = ++p;
+/* servers can send channel MODEs and KICKs */
+static void
+cmd_mode(Conn *cn, const Ircmsg *m)
+{
+	int r;
+
+	r = snprintf(msg, sizeof(msg), "-!- %.*s changed mode/%.*s -> ",
+		     SPAN(m->nick), SPAN(irc_param(m, 0)));
+	if (r >= 0 && (size_t)r < sizeof(msg))
+		irc_params_join(m, 1, msg + r, sizeof(msg) - r);
+        if (trackprefix)
+                name_mode(cn, m);
+	server_print(cn, m);
+}
+
+static void
+cmd_kick(Conn *cn, const Ircmsg *m)
+{
+	char chan[IRC_CHANNEL_MAX], nick[IRC_NICK_MAX];
+
+	if (m->nparams < 2)
+		return;
+	snprintf(msg, sizeof(msg), "-!- %.*s kicked %.*s (\"%.*s\")",
+		 SPAN(m->nick), SPAN(m->params[1]), SPAN(irc_param(m, 2)));
+	name_rm(cn, span_str(m->params[0], chan, sizeof(chan)),
+	        span_str(m->params[1], nick, sizeof(nick)));
+	server_print(cn, m);
+}
+
+/* servers can also send TOPIC lines (cf. recovering from netsplit) */
+static void
+cmd_topic(Conn *cn, const Ircmsg *m)
+{
+	snprintf(msg, sizeof(msg), "-!- %.*s changed topic to \"%.*s\"",
+		 SPAN(m->nick), SPAN(irc_param(m, 1)));
+	server_print(cn, m);
+}
+
+/* registered. after a reconnect the channels are joined again, as few
+ * JOIN lines as fit, and the "in" FIFOs are read again. */
+static void
+cmd_welcome(Conn *cn, const Ircmsg *m)
+{
+	Channel *c;
+	char buf[IRC_MSG_MAX];
+	size_t len = 0, n;
+
+	(void)m;
+	if (cn->registered)
+		return;
+	cn->registered = 1;
+	cn->retries = 0;
+	if (cn->fifosblocked && cn->sqlen <= SENDQ_LOWAT)
+		fifos_block(cn, 0);
+	if (!cn->st.nreconnect)
+		return; /* first connection, nothing to join again */
+	for (c = cn->channels; c; c = c->next) {
+		if (c->name[0] != '#' && c->name[0] != '&' &&
+		    c->name[0] != '+' && c->name[0] != '!')
+			continue;
+		n = strlen(c->name);
+		if (len && len + 1 + n + 2 >= sizeof(buf)) {
+			memcpy(buf + len, "\r\n", 3);
+			sched_push(cn, NULL, buf);
+			len = 0;
 		}
-	} else {
-		cmd = buf;
+		if (len + 5 + n + 2 >= sizeof(buf))
+			continue; /* cannot be joined anyway */
+		len += snprintf(buf + len, sizeof(buf) - len, "%s%s",
+		                len ? "," : "JOIN ", c->name);
 	}
-
-	/* remove CRLFs */
-	for (p = cmd; p && *p != '\0'; p++) {
-		if (*p == '\r' || *p == '\n')
-			*p = '\0';
+	if (len) {
+		memcpy(buf + len, "\r\n", 3);
+		sched_push(cn, NULL, buf);
 	}
+}
 
-	tokenize(&argv[TOK_CMD], cmd);
-	
-	if (!argv[TOK_CMD] || !strcmp("PONG", argv[TOK_CMD])) {
-                return;                
-	} else if (!strcmp("PING", argv[TOK_CMD])) {
-		snprintf(msg, sizeof(msg), "PONG %s\r\n", argv[TOK_TEXT]);
-		ewritestr(fd, msg);
-                return;
-	} else if (!strncmp("353", argv[TOK_CMD], 4)) {
-		p = argv[TOK_TEXT]; /* channel name */
-		if ((q = strchr(p,' ')) == NULL) /* space after channel name */
-			return;
-		*q++ = '\0'; /* terminate channel name and advance */
-		if ((q = strtok(q, ":")) == NULL) /* beginning of names list */
-			return;
+static void
+cmd_error(Conn *cn, const Ircmsg *m)
+{
+	if (m->nparams)
+		snprintf(msg, sizeof(msg), "-!- error %.*s",
+			 SPAN(m->params[m->nparams - 1]));
+	else
+		snprintf(msg, sizeof(msg), "-!- error unknown");
+	server_print(cn, m);
+}
 
-		snprintf(msg, sizeof(msg), "%s%s %s",
-			 argv[TOK_ARG] ? argv[TOK_ARG] : "", p, q);
-		channel_print(channelmaster, msg);
-		proc_names(p, q);
-		return;
-        } else if (!strncmp("005", argv[TOK_CMD], 4)) {
-		/* the tokeniser can't split 005 lines properly while handling
-		 * other numerics in the general case */
-		snprintf(msg, sizeof(msg), "%s %s",
-			 	argv[TOK_ARG] ? argv[TOK_ARG] : "",
-				argv[TOK_TEXT] ? argv[TOK_TEXT] : "");
-		channel_print(channelmaster, msg);
-                cap_parse(argv[TOK_ARG]);
-                cap_parse(argv[TOK_TEXT]);
-                return;
-        } else if (!strcmp("MODE", argv[TOK_CMD])) { /* servers can send channel MODEs and KICKs */
-		snprintf(msg, sizeof(msg), "-!- %s changed mode/%s -> %s %s",
-				argv[TOK_NICKSRV],
-				argv[TOK_CHAN] ? argv[TOK_CHAN] : "",
-				argv[TOK_ARG]  ? argv[TOK_ARG] : "",
-                                argv[TOK_TEXT] ? argv[TOK_TEXT] : "");
-                if (trackprefix) name_mode(argv[TOK_CHAN], argv[TOK_ARG], argv[TOK_TEXT]);
-	} else if (!strcmp("KICK", argv[TOK_CMD]) && argv[TOK_ARG]) {
-		snprintf(msg, sizeof(msg), "-!- %s kicked %s (\"%s\")",
-			 	argv[TOK_NICKSRV], argv[TOK_ARG],
-			 	argv[TOK_TEXT] ? argv[TOK_TEXT] : "");
-		name_rm(argv[TOK_CHAN], argv[TOK_ARG]);
-	} else if (!strcmp("TOPIC", argv[TOK_CMD])) { /* servers can also send TOPIC lines (cf. recovering from netsplit) */
-		snprintf(msg, sizeof(msg), "-!- %s changed topic to \"%s\"",
-				argv[TOK_NICKSRV],
-				argv[TOK_TEXT] ? argv[TOK_TEXT] : "");
-        } else if (!argv[TOK_NICKSRV] || !argv[TOK_USER]) {
-                /* server message */
-		snprintf(msg, sizeof(msg), "%s%s%s",
-			 	argv[TOK_ARG] ? argv[TOK_ARG] : "",
-			 	argv[TOK_ARG] && argv[TOK_TEXT] ? " " : "",
-				argv[TOK_TEXT] ? argv[TOK_TEXT] : "");
-		channel_print(channelmaster, msg);
-		return; /* don't process further */
-	} else if (!strcmp("ERROR", argv[TOK_CMD]))
-		snprintf(msg, sizeof(msg), "-!- error %s",
-				argv[TOK_TEXT] ? argv[TOK_TEXT] : "unknown");
-	else if (!strcmp("JOIN", argv[TOK_CMD]) && (argv[TOK_CHAN] || argv[TOK_TEXT])) {
-		if (argv[TOK_TEXT])
-                        argv[TOK_CHAN] = argv[TOK_TEXT];
-                snprintf(msg, sizeof(msg), "-!- %s(%s) has joined %s",
-                         argv[TOK_NICKSRV], argv[TOK_USER], argv[TOK_CHAN]);
-                name_add(argv[TOK_CHAN], argv[TOK_NICKSRV]);
-        } else if (!strcmp("PART", argv[TOK_CMD]) && argv[TOK_CHAN]) {
-		snprintf(msg, sizeof(msg), "-!- %s(%s) has left %s: \"%s\"",
-			 argv[TOK_NICKSRV], argv[TOK_USER], argv[TOK_CHAN],
-			 argv[TOK_TEXT] ? argv[TOK_TEXT] : "");
-		/* if user itself leaves, don't write to channel (don't reopen channel). */
-		if (!strcmp(argv[TOK_NICKSRV], nick))
-			return;
-                name_rm(argv[TOK_CHAN], argv[TOK_NICKSRV]);
-	} else if (!strcmp("QUIT", argv[TOK_CMD])) {
-		snprintf(msg, sizeof(msg), "-!- %s(%s) has quit \"%s\"",
-				argv[TOK_NICKSRV], argv[TOK_USER],
-                                argv[TOK_TEXT] ? argv[TOK_TEXT] : "");
-                name_quit(argv[TOK_NICKSRV], argv[TOK_USER], argv[TOK_TEXT]);
+static void
+cmd_join(Conn *cn, const Ircmsg *m)
+{
+	char chan[IRC_CHANNEL_MAX], nick[IRC_NICK_MAX];
+
+	if (!m->nparams)
 		return;
+	snprintf(msg, sizeof(msg), "-!- %.*s(%.*s) has joined %.*s",
+		 SPAN(m->nick), SPAN(irc_userhost(m)), SPAN(m->params[0]));
+	name_add(channel_find(cn, span_str(m->params[0], chan, sizeof(chan))),
+	         span_str(m->nick, nick, sizeof(nick)));
+	server_print(cn, m);
+}
 
-	/* the brokenness which is almost every IRC server implementation sending RFC
-	 * incompliant NICK messages deserves special mention. shoutout to inspircd,
-	 * whose maintainers appear to have actually read the standards. */
+static void
+cmd_part(Conn *cn, const Ircmsg *m)
+{
+	char chan[IRC_CHANNEL_MAX], nick[IRC_NICK_MAX];
 
-	/* many servers send a NICK message and prepend the new nick with a colon */
-	} else if (!strncmp("NICK", argv[TOK_CMD], 5) && argv[TOK_TEXT] &&
-	          !strcmp(_nick, argv[TOK_TEXT])) {
-		strlcpy(nick, _nick, sizeof(nick));
-		snprintf(msg, sizeof(msg), "-!- changed nick to \"%s\"", nick);
-                name_menick(argv[TOK_NICKSRV], argv[TOK_TEXT]);
-                return;
-	} else if (!strcmp("NICK", argv[TOK_CMD]) && argv[TOK_TEXT]) {
-		snprintf(msg, sizeof(msg), "-!- %s changed nick to %s",
-                         argv[TOK_NICKSRV], argv[TOK_TEXT]);
-                name_nick(argv[TOK_NICKSRV], argv[TOK_TEXT]);
+	if (!m->nparams)
 		return;
+	/* if user itself leaves, don't write to channel (don't reopen channel). */
+	if (span_eq(m->nick, cn->nick))
+		return;
+	snprintf(msg, sizeof(msg), "-!- %.*s(%.*s) has left %.*s: \"%.*s\"",
+		 SPAN(m->nick), SPAN(irc_userhost(m)), SPAN(m->params[0]),
+		 SPAN(irc_param(m, 1)));
+	name_rm(cn, span_str(m->params[0], chan, sizeof(chan)),
+	        span_str(m->nick, nick, sizeof(nick)));
+	server_print(cn, m);
+}
 
-	/* inspircd (correctly) does *not* prepend a colon */
-	} else if (!strncmp("NICK", argv[TOK_CMD], 5) && argv[TOK_CHAN] &&
-	          !strcmp(_nick, argv[TOK_CHAN])) {
-		strlcpy(nick, _nick, sizeof(nick));
-		snprintf(msg, sizeof(msg), "-!- changed nick to \"%s\"", nick);
-                name_menick(argv[TOK_NICKSRV], argv[TOK_CHAN]);
-                return;
-	} else if (!strcmp("NICK", argv[TOK_CMD]) && argv[TOK_CHAN]) {
-		snprintf(msg, sizeof(msg), "-!- %s changed nick to %s",
-                         argv[TOK_NICKSRV], argv[TOK_CHAN]);
-                name_nick(argv[TOK_NICKSRV], argv[TOK_CHAN]);
-                return;
+static void
+cmd_quit(Conn *cn, const Ircmsg *m)
+{
+	char nick[IRC_NICK_MAX];
+
+	snprintf(msg, sizeof(msg), "-!- %.*s(%.*s) has quit \"%.*s\"",
+		 SPAN(m->nick), SPAN(irc_userhost(m)), SPAN(irc_param(m, 0)));
+	name_quit(cn, span_str(m->nick, nick, sizeof(nick)));
+}
 
+/* many servers send a NICK message and prepend the new nick with a colon,
+ * inspircd (correctly) does not; the parser handles both. */
+static void
+cmd_nick(Conn *cn, const Ircmsg *m)
+{
+	char old[IRC_NICK_MAX], new[IRC_NICK_MAX];
 
-	} else if (!strcmp("NOTICE", argv[TOK_CMD])) {
-                isnotice = 1; /* this is a hack, as we need to know who/what
-                               * we're sending to before we can format the
-                               * message */
-        } else if (!strcmp("PRIVMSG", argv[TOK_CMD])) {
-                isprivmsg = 1; /* hack, as above. */
+	if (!m->nparams)
+		return;
+	span_str(m->nick, old, sizeof(old));
+	span_str(m->params[0], new, sizeof(new));
+	if (!strcmp(cn->_nick, new)) {
+		strlcpy(cn->nick, cn->_nick, sizeof(cn->nick));
+		name_menick(cn, old, new);
 	} else {
-		return; /* can't read this message */
+		name_nick(cn, old, new);
 	}
-        if (argv[TOK_CHAN] && !strcmp(argv[TOK_CHAN], nick)) {
-                channel = argv[TOK_NICKSRV];
+}
+
+static void
+privmsg_print(Conn *cn, const Ircmsg *m, int isnotice)
+{
+	Channel *c = NULL;
+	Nick *n = NULL;
+	char channel[IRC_CHANNEL_MAX], nick[IRC_NICK_MAX];
+	Span target = irc_param(m, 0), text = irc_param(m, 1);
+
+	span_str(m->nick, nick, sizeof(nick));
+        if (span_eq(target, cn->nick)) {
+                strlcpy(channel, nick, sizeof(channel));
 
                 if (isnotice)
-                        snprintf(msg, sizeof(msg), "-!- \"%s\"",
-                                 argv[TOK_TEXT] ? argv[TOK_TEXT] : "");
-                else if (isprivmsg)
-                        snprintf(msg, sizeof(msg), "<%s> %s", argv[TOK_NICKSRV],
-                                 argv[TOK_TEXT] ? argv[TOK_TEXT] : "");
+                        snprintf(msg, sizeof(msg), "-!- \"%.*s\"", SPAN(text));
+                else
+                        snprintf(msg, sizeof(msg), "<%s> %.*s", nick, SPAN(text));
         } else {
-                channel = argv[TOK_CHAN];
-                Nick *n = NULL;
+                span_str(target, channel, sizeof(channel));
 
+                /* look the channel up once, for both the prefix and
+                 * printing */
+                if (channel[0] != '\0')
+                        c = channel_join(cn, channel);
                 if (trackprefix)
-                        n = name_find(channel_find(channel), argv[TOK_NICKSRV]);
-                
+                        n = name_find(c, nick);
+
                 if (isnotice)
-                        snprintf(msg, sizeof(msg), "-!- %s%s/%s -> \"%s\"",
-                                 n ? &n->prefix : "",
-                                 argv[TOK_NICKSRV] ? argv[TOK_NICKSRV] : "",
-                                 channel, argv[TOK_TEXT] ? argv[TOK_TEXT] : "");
-                else if (isprivmsg) {
-                        snprintf(msg, sizeof(msg), "<%s%s> %s", n ? &n->prefix : "",
-                                 argv[TOK_NICKSRV],
-                                 argv[TOK_TEXT] ? argv[TOK_TEXT] : "");
-                }
+                        snprintf(msg, sizeof(msg), "-!- %s%s/%s -> \"%.*s\"",
+                                 n ? &n->prefix : "", nick, channel, SPAN(text));
+                else
+                        snprintf(msg, sizeof(msg), "<%s%s> %.*s",
+                                 n ? &n->prefix : "", nick, SPAN(text));
         }
 
-	if (!channel || channel[0] == '\0')
-		c = channelmaster;
-	else
-		c = channel_join(channel);
+	if (channel[0] == '\0')
+		c = cn->channelmaster;
+	else if (!c)
+		c = channel_join(cn, channel);
 	if (c)
 		channel_print(c, msg);
 }
 
 static void
-proc_names(const char *chan, char *names) {
-	char *p;
+cmd_notice(Conn *cn, const Ircmsg *m)
+{
+	privmsg_print(cn, m, 1);
+}
+
+static void
+cmd_privmsg(Conn *cn, const Ircmsg *m)
+{
+	privmsg_print(cn, m, 0);
+}
+
+/* the command names, packed into an integer by their first four bytes. these
+ * are unique among the commands in cmds[], so one switch and one compare find
+ * the handler for a line. */
+static const Cmd *
+cmd_find(Span s)
+{
+	unsigned long key = 0;
+	size_t i;
+	int c;
+
+	for (i = 0; i < 4; i++)
+		key = key << 8 | (i < s.len ? (unsigned char)s.p[i] : 0);
+	switch (key) {
+	case CMDKEY('E','R','R','O'): c = CMD_ERROR;   break;
+	case CMDKEY('J','O','I','N'): c = CMD_JOIN;    break;
+	case CMDKEY('K','I','C','K'): c = CMD_KICK;    break;
+	case CMDKEY('M','O','D','E'): c = CMD_MODE;    break;
+	case CMDKEY('N','I','C','K'): c = CMD_NICK;    break;
+	case CMDKEY('N','O','T','I'): c = CMD_NOTICE;  break;
+	case CMDKEY('P','A','R','T'): c = CMD_PART;    break;
+	case CMDKEY('P','I','N','G'): c = CMD_PING;    break;
+	case CMDKEY('P','O','N','G'): c = CMD_PONG;    break;
+	case CMDKEY('P','R','I','V'): c = CMD_PRIVMSG; break;
+	case CMDKEY('Q','U','I','T'): c = CMD_QUIT;    break;
+	case CMDKEY('T','O','P','I'): c = CMD_TOPIC;   break;
+	default: return NULL;
+	}
+	return span_eq(s, cmds[c].name) ? &cmds[c] : NULL;
+}
+
+static void
+proc_server_cmd(Conn *cn, const char *buf)
+{
+	const Cmd *cmd = NULL;
+	Ircmsg m;
+
+	/* anything after a CR or LF is not part of the line */
+	if (irc_parse(&m, buf, strcspn(buf, "\r\n")) == -1)
+		return;
+	if (m.num)
+		cn->st.nnumeric++;
+
+	switch (m.num) {
+	case 0:
+		if ((cmd = cmd_find(m.cmd)))
+			cn->st.ncmd[cmd - cmds]++;
+		else
+			cn->st.nother++;
+		break;
+	case RPL_WELCOME:
+		cmd_welcome(cn, &m);
+		break;
+	case RPL_ISUPPORT:
+		cmd_isupport(cn, &m);
+		return;
+	case RPL_NAMREPLY:
+		cmd_names(cn, &m);
+		return;
+	}
+
+	if (cmd && cmd->fromserver) {
+		cmd->fn(cn, &m);
+	} else if (!m.user.p) {
+                /* server message, skipping our own nick */
+		irc_params_join(&m, m.nparams > 1, msg, sizeof(msg));
+		channel_print(cn->channelmaster, msg);
+	} else if (cmd) {
+		cmd->fn(cn, &m);
+	}
+}
+
+/* names is a space separated list of nicks, with their prefix chars */
+static void
+proc_names(Conn *cn, Span chan, Span names) {
+	Channel *c;
+	char buf[IRC_CHANNEL_MAX], nick[IRC_NICK_MAX];
+	const char *q, *end = names.p + names.len;
+	Span s;
 
-        if(!(p = strtok(names," ")))
+        if (!(c = channel_find(cn, span_str(chan, buf, sizeof(buf)))))
                 return;
-	do {
-		name_add(chan,p);
-	} while((p = strtok(NULL," ")));
+	for (s.p = names.p; s.p < end; s.p = q + 1) {
+		if (!(q = memchr(s.p, ' ', end - s.p)))
+			q = end;
+		if ((s.len = q - s.p))
+			name_add(c, span_str(s, nick, sizeof(nick)));
+	}
 }
 
 static int
@@ -1155,7 +4382,7 @@ read_line(int fd, char *buf, size_t bufsiz)
 }
 
 static void
-handle_channels_input(int ircfd, Channel *c)
+handle_channels_input(Channel *c)
 {
 	char buf[IRC_MSG_MAX];
 
@@ -1164,22 +4391,202 @@ handle_channels_input(int ircfd, Channel *c)
 			channel_rm(c);
 		return;
 	}
-	proc_channels_input(ircfd, c, buf);
+	proc_channels_input(c->cn, c, buf);
 }
 
+/* echo a server line to stdout and process it, timing proc_server_cmd() */
 static void
-handle_server_output(int infd, int outfd)
+server_line(Conn *cn, const char *line)
 {
-	char buf[IRC_MSG_MAX];
+	const char *ts;
+	char *p;
+	long long t0, dt;
+	size_t len, tslen;
+	int i;
+
+	cn->rb.nlines++;
+	ts = timestamp(&tslen);
+	len = strlen(line);
+	if ((p = outq_reserve(tslen + len + 1, 0))) {
+		memcpy(p, ts, tslen);
+		memcpy(p + tslen, line, len);
+		p[tslen + len] = '\n';
+		outq_commit(NULL, OUT_LINE, tslen + len + 1);
+	} else {
+		cn->st.ndrop++;
+	}
+	t0 = uptime_ns();
+	proc_server_cmd(cn, line);
+	dt = uptime_ns() - t0;
+	for (i = 0; i < HIST_MAX - 1 && dt >= (128LL << i); i++)
+		;
+	cn->st.hist[i]++;
+}
 
-	if (read_line(infd, buf, sizeof(buf)) == -1) {
-		fprintf(stderr, "%s: remote host closed connection: %s\n",
-		        argv0, strerror(errno));
-		exit(1);
+/* the server closed the connection (err 0) or reading from it failed */
+static void
+server_lost(Conn *cn, int err)
+{
+	fprintf(stderr, "%s: %s: remote host closed connection: %s\n",
+	        argv0, cn->host, err ? strerror(err) : "end of file");
+	conn_lost(cn, 1);
+}
+
+/* dispatch every complete line after len new bytes were added to the
+ * receive buffer. a partial line at the end is kept for the next call. */
+static void
+server_input(Conn *cn, size_t len)
+{
+	Linebuf *lb = &cn->rb;
+	char *line, *end, *p;
+
+	lb->len += len;
+	cn->st.bytesin += len;
+	end = lb->buf + lb->len;
+
+	for (line = lb->buf; (p = memchr(line, '\n', end - line)); line = p + 1) {
+		if (lb->discard) {
+			lb->discard = 0;
+			continue;
+		}
+		*p = '\0'; /* eliminates '\n' */
+		if (p > line && p[-1] == '\r')
+			p[-1] = '\0';
+		server_line(cn, line);
+	}
+
+	if (lb->discard) {
+		line = end; /* still inside an overlong line */
+	} else if (line == lb->buf && lb->len == sizeof(lb->buf)) {
+		/* no line terminator in a full buffer: dispatch what we have and
+		 * drop the rest of the line when it arrives. */
+		lb->buf[lb->len - 1] = '\0';
+		server_line(cn, lb->buf);
+		lb->discard = 1;
+		line = end;
+	}
+	lb->len = end - line;
+	memmove(lb->buf, line, lb->len);
+}
+
+/* read as much as the server has sent in one go */
+static void
+handle_server_output(Conn *cn)
+{
+	Linebuf *lb = &cn->rb;
+	ssize_t r;
+
+#ifdef USE_TLS
+	if (cn->ssl) {
+		tls_read(cn);
+		return;
+	}
+#endif
+	r = read(cn->infd, lb->buf + lb->len, sizeof(lb->buf) - lb->len);
+	if (r <= 0) {
+		if (r == -1 && (errno == EINTR || errno == EAGAIN ||
+		    errno == EWOULDBLOCK))
+			return;
+		server_lost(cn, r == 0 ? 0 : errno);
+		return;
+	}
+	lb->nreads++;
+	server_input(cn, r);
+}
+
+/* data io_uring received for the server (EV_DATA). it goes through the
+ * receive buffer in as many pieces as it takes. */
+static void
+server_recv(Conn *cn, const char *data, ssize_t len)
+{
+	Linebuf *lb = &cn->rb;
+	size_t n;
+
+	if (len <= 0) {
+		server_lost(cn, -len);
+		return;
+	}
+	lb->nreads++;
+#ifdef USE_TLS
+	if (cn->ssl) {
+		tls_recv(cn, data, len);
+		return;
+	}
+#endif
+	for (; len > 0; data += n, len -= n) {
+		n = sizeof(lb->buf) - lb->len;
+		if (n > (size_t)len)
+			n = len;
+		memcpy(lb->buf + lb->len, data, n);
+		server_input(cn, n);
+	}
+}
+
+/* write the counters of a connection to <ircpath>/stats as "name value"
+ * lines. the file is replaced in one go, so readers never see half of it. */
+static int
+stats_write(Conn *cn)
+{
+	char path[PATH_MAX], tmp[PATH_MAX];
+	Channel *c;
+	FILE *fp;
+	Stats *st = &cn->st;
+	unsigned long nchan = 0, nnicks = 0, nmq = 0, maxmq = 0;
+	int i;
+
+	st->written = clk.tv_sec;
+	for (c = cn->channels; c; c = c->next) {
+		nchan++;
+		nnicks += c->nnicks;
+		nmq += c->nmq;
+		if (c->nmq > maxmq)
+			maxmq = c->nmq;
+	}
+
+	if (snprintf(path, sizeof(path), "%s/stats", cn->ircpath) >= (int)sizeof(path) ||
+	    snprintf(tmp, sizeof(tmp), "%s/.stats", cn->ircpath) >= (int)sizeof(tmp)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	if (!(fp = fopen(tmp, "w")))
+		return -1;
+	fprintf(fp, "uptime %lu\n", (unsigned long)(st->written - st->started));
+	fprintf(fp, "reads_in %lu\n", cn->rb.nreads);
+	fprintf(fp, "lines_in %lu\n", cn->rb.nlines);
+	fprintf(fp, "bytes_in %llu\n", st->bytesin);
+	fprintf(fp, "lines_out %llu\n", st->linesout);
+	fprintf(fp, "bytes_out %llu\n", st->bytesout);
+	for (i = 0; i < CMD_LAST; i++)
+		fprintf(fp, "cmd_%s %lu\n", cmds[i].name, st->ncmd[i]);
+	fprintf(fp, "cmd_numeric %lu\n", st->nnumeric);
+	fprintf(fp, "cmd_other %lu\n", st->nother);
+	fprintf(fp, "prints %llu\n", st->nprint);
+	fprintf(fp, "print_bytes %llu\n", st->printbytes);
+	fprintf(fp, "out_drops %lu\n", st->ndrop);
+	fprintf(fp, "reconnects %lu\n", st->nreconnect);
+	fprintf(fp, "out_rolls %lu\n", __atomic_load_n(&outrolls, __ATOMIC_RELAXED));
+	fprintf(fp, "out_syncs %lu\n", __atomic_load_n(&outsyncs, __ATOMIC_RELAXED));
+	fprintf(fp, "out_queue_bytes %lu\n", (unsigned long)(outqnext -
+	        __atomic_load_n(&outqtail, __ATOMIC_RELAXED)));
+	fprintf(fp, "channels %lu\n", nchan);
+	fprintf(fp, "nicks %lu\n", nnicks); /* channel memberships */
+	fprintf(fp, "users %lu\n", (unsigned long)cn->nusertab);
+	fprintf(fp, "out_files_open %d\n", __atomic_load_n(&noutfds, __ATOMIC_RELAXED));
+	fprintf(fp, "sendq_bytes %lu\n", (unsigned long)cn->sqlen);
+	fprintf(fp, "floodq_lines %lu\n", nmq);
+#ifdef USE_TLS
+	if (cn->ssl)
+		fprintf(fp, "tls_resumed %d\n", SSL_session_reused(cn->ssl));
+#endif
+	fprintf(fp, "floodq_max %lu\n", maxmq);
+	for (i = 0; i < HIST_MAX - 1; i++)
+		fprintf(fp, "proc_ns_lt_%lld %lu\n", 128LL << i, st->hist[i]);
+	fprintf(fp, "proc_ns_more %lu\n", st->hist[HIST_MAX - 1]);
+	if (fclose(fp) == EOF || rename(tmp, path) == -1) {
+		unlink(tmp);
+		return -1;
 	}
-	fprintf(stdout, "%lu %s\n", (unsigned long)time(NULL), buf);
-	fflush(stdout);
-	proc_server_cmd(outfd, buf);
+	return 0;
 }
 
 static void
@@ -1187,6 +4594,8 @@ sighandler(int sig)
 {
 	if (sig == SIGTERM || sig == SIGINT)
 		isrunning = 0;
+	else if (sig == SIGHUP)
+		reopenout = 1;
 }
 
 static void
@@ -1198,61 +4607,116 @@ setup(void)
 	sa.sa_handler = sighandler;
 	sigaction(SIGTERM, &sa, NULL);
         sigaction(SIGINT, &sa, NULL);
-
-        /* default values for prefixes and channel modes. these need
-         * to be tracked regardless of whether we're keeping track of
-         * people's modes, because we still need to know what the prefix
-         * chars so we can skip them. */
-        parse_prefix("(qaohv)~&@%+");
-        parse_cmodes("beI,k,l,imMnOPQRstVz");
+	sigaction(SIGHUP, &sa, NULL);
+	/* a connection that went away is noticed on write(2) */
+	sa.sa_handler = SIG_IGN;
+	sigaction(SIGPIPE, &sa, NULL);
 }
 
 static void
-run(int ircinfd, int ircoutfd, const char *host)
+run(void)
 {
-	Channel *c, *tmp;
-	fd_set rdset;
-	struct timeval tv;
+	Channel *c;
+	Conn *cn, *tmp;
 	char ping_msg[IRC_MSG_MAX];
-	int r, maxfd;
-
-	snprintf(ping_msg, sizeof(ping_msg), "PING %s\r\n", host);
-	while (isrunning) {
-                maxfd = ircinfd > ircoutfd ? ircinfd : ircoutfd;
-		FD_ZERO(&rdset);
-		FD_SET(ircinfd, &rdset);
-		for (c = channels; c; c = c->next) {
-			if (c->fdin > maxfd)
-				maxfd = c->fdin;
-			FD_SET(c->fdin, &rdset);
+	time_t now;
+	void *src;
+	int i, r, timeout, t;
+
+	while (isrunning && conns) {
+		if (reopenout) {
+			reopenout = 0;
+			outq_ctl(NULL, OUT_REOPEN);
+		}
+
+		now = clk.tv_sec;
+		timeout = PING_INTERVAL * 1000;
+		for (cn = conns; cn; cn = tmp) {
+			tmp = cn->next;
+			if (!cn->running) {
+				conn_free(cn, 1);
+				continue;
+			}
+			if (!cn->connected) {
+				if (cn->connecting)
+					t = conn_step(cn, 0);
+				else
+					t = now >= cn->retryat ? conn_connect(cn) : 0;
+				if (t == -1) /* this attempt failed */
+					conn_retry(cn);
+				if (!cn->connected) {
+					if (!cn->connecting)
+						t = (cn->retryat - now) * 1000;
+					if (t < timeout)
+						timeout = t > 0 ? t : 0;
+					continue;
+				}
+			}
+			if (now - cn->last_response >= PING_TIMEOUT) {
+				for (c = cn->channels; c; c = c->next)
+					channel_print(c, "-!- ii: ping timeout");
+				conn_lost(cn, 2); /* status code 2 for timeout */
+				continue;
+			}
+			if (now - cn->st.written >= STATS_INTERVAL)
+				stats_write(cn);
+			if (now - cn->last_response >= PING_INTERVAL &&
+			    now - cn->last_ping >= PING_INTERVAL) {
+				snprintf(ping_msg, sizeof(ping_msg), "PING %s\r\n",
+				         cn->host);
+				sched_push(cn, NULL, ping_msg);
+				cn->last_ping = now;
+			}
+
+			/* release what the flood control allows and send
+			 * everything the last iteration queued, in one go.
+			 * channel lines wait for 001: the server would reject
+			 * them before, and after a reconnect the JOINs go
+			 * first */
+			t = cn->registered ? sched_run(cn) : -1;
+			if (cn->sqlen && !cn->sqwait)
+				conn_flush(cn);
+			if (t > 0 && t < timeout) /* else nothing waiting, or
+			                           * waiting on the socket */
+				timeout = t;
 		}
-		memset(&tv, 0, sizeof(tv));
-		tv.tv_sec = 120;
-		r = select(maxfd + 1, &rdset, 0, 0, &tv);
+		if (!conns)
+			break;
+
+		outq_publish();
+		r = ev_wait(timeout);
+		clock_update();
 		if (r < 0) {
 			if (errno == EINTR)
 				continue;
-			fprintf(stderr, "%s: select: %s\n", argv0, strerror(errno));
+			fprintf(stderr, "%s: poll: %s\n", argv0, strerror(errno));
 			exit(1);
-		} else if (r == 0) {
-			if (time(NULL) - last_response >= PING_TIMEOUT) {
-                                for (c = channels; c; c = tmp) {
-                                        tmp = c->next;
-                                        channel_print(c, "-!- ii shutting down: ping timeout");
-                                }
-				exit(2); /* status code 2 for timeout */
-			}
-			ewritestr(ircoutfd, ping_msg);
-			continue;
 		}
-		if (FD_ISSET(ircinfd, &rdset)) {
-			handle_server_output(ircinfd, ircoutfd);
-			last_response = time(NULL);
-		}
-		for (c = channels; c; c = tmp) {
-			tmp = c->next;
-			if (FD_ISSET(c->fdin, &rdset))
-				handle_channels_input(ircoutfd, c);
+		for (i = 0; i < r; i++) {
+			/* entries are cleared by ev_del() if a handler removes
+			 * the channel or connection they refer to. */
+			if (!(src = evready[i].src))
+				continue;
+			if (*(int *)src == SRC_CONN) {
+				cn = src;
+				if (cn->connecting)
+					continue; /* conn_step() looks at it */
+				if (evready[i].flags & EV_WRITE)
+					conn_flush(cn);
+				if (evready[i].flags & EV_DATA) {
+					cn->last_response = clk.tv_sec;
+					server_recv(cn, evready[i].data, evready[i].len);
+				} else if (evready[i].flags & EV_READ) {
+					cn->last_response = clk.tv_sec;
+					handle_server_output(cn);
+				}
+			} else {
+				c = src;
+				/* stale if the FIFO was blocked meanwhile; it is
+				 * polled again once its lines have been sent */
+				if (!c->cn->fifosblocked && !c->inblocked)
+					handle_channels_input(c);
+			}
 		}
 	}
 }
@@ -1260,99 +4724,185 @@ run(int ircinfd, int ircoutfd, const char *host)
 int
 main(int argc, char *argv[])
 {
-	Channel *c, *tmp;
+	static Conn tmpl; /* options given before the first -s */
+	Conn *cn, *last = NULL;
 	struct passwd *spw;
-        const char *key = NULL, *username = NULL, *fullname = NULL;
-        const char *host = "", *uds = NULL, *service = "6667";
-	char prefix[PATH_MAX];
-        int ircinfd, ircoutfd, r;
-        int ucspi = 0;
+	const char *ts;
+	char *end;
+#ifdef __OpenBSD__
+	char promises[64];
+#endif
 
 	/* use nickname and home dir of user by default */
 	if (!(spw = getpwuid(getuid()))) {
 		fprintf(stderr, "%s: getpwuid: %s\n", argv0, strerror(errno));
 		exit(1);
 	}
-	strlcpy(nick, spw->pw_name, sizeof(nick));
+	strlcpy(tmpl.nick, spw->pw_name, sizeof(tmpl.nick));
 	snprintf(prefix, sizeof(prefix), "%s/irc", spw->pw_dir);
 
-        username = nick;
-        
+	/* server options apply to the server named by the last -s, or to
+	 * all servers when given before the first one */
+	cn = &tmpl;
 	ARGBEGIN {
 	case 'f':
-		fullname = EARGF(usage());
+		cn->fullname = EARGF(usage());
 		break;
 	case 'i':
 		strlcpy(prefix, EARGF(usage()), sizeof(prefix));
 		break;
 	case 'k':
-		key = getenv(EARGF(usage()));
+		cn->key = getenv(EARGF(usage()));
 		break;
 	case 'n':
-		strlcpy(nick, EARGF(usage()), sizeof(nick));
+		strlcpy(cn->nick, EARGF(usage()), sizeof(cn->nick));
 		break;
 	case 'p':
-		service = EARGF(usage());
+		cn->service = EARGF(usage());
+		break;
+	case 'e':
+		cn->tls = 1;
+		break;
+	case 'C':
+		cn->cafile = EARGF(usage());
 		break;
 	case 's':
-		host = EARGF(usage());
+		tmpl.host = EARGF(usage());
+		cn = conn_new(&tmpl);
+		if (last)
+			last->next = cn;
+		else
+			conns = cn;
+		last = cn;
                 break;
         case 'u':
-                username = EARGF(usage());
+                cn->username = EARGF(usage());
                 break;
 	case 'U':
-		uds = EARGF(usage());
+		cn->uds = EARGF(usage());
                 break;
         case 't':
-                ucspi = 1;
+                cn->ucspi = 1;
                 break;
         case 'P':
                 trackprefix = 0;
                 break;
+	case 'r':
+		floodrate = strtod(EARGF(usage()), NULL);
+		break;
+	case 'b':
+		floodburst = atoi(EARGF(usage()));
+		break;
+	case 'l':
+		outmax = strtoll(EARGF(usage()), &end, 10);
+		switch (*end) {
+		case 'G':
+			outmax <<= 10; /* FALLTHROUGH */
+		case 'M':
+			outmax <<= 10; /* FALLTHROUGH */
+		case 'k':
+		case 'K':
+			outmax <<= 10;
+			end++;
+			break;
+		}
+		if (*end || outmax < 0)
+			usage();
+		break;
+	case 'd':
+		outdaily = 1;
+		break;
+	case 'N':
+		outkeep = atoi(EARGF(usage()));
+		break;
+	case 'W':
+		ts = EARGF(usage());
+		if (!strcmp(ts, "block"))
+			outdrop = 0;
+		else if (!strcmp(ts, "drop"))
+			outdrop = 1;
+		else
+			usage();
+		break;
+	case 'R':
+		reconnmax = atoi(EARGF(usage()));
+		break;
+	case 'S':
+		ts = EARGF(usage());
+		if (!strcmp(ts, "none"))
+			outsync = -1;
+		else if (!strcmp(ts, "batch"))
+			outsync = 0;
+		else if ((outsync = atoi(ts)) <= 0)
+			usage();
+		break;
+	case 'T':
+		ts = EARGF(usage());
+		if (!strcmp(ts, "s"))
+			tsprec = 0;
+		else if (!strcmp(ts, "ms"))
+			tsprec = 3;
+		else if (!strcmp(ts, "us"))
+			tsprec = 6;
+		else
+			usage();
+		break;
 	default:
 		usage();
 		break;
 	} ARGEND;
 
-	if (!*host)
+	if (!conns || floodburst < 1 || outkeep < 0 || reconnmax < 0)
 		usage();
-
-	if (uds)
-                ircinfd = ircoutfd = udsopen(uds);
-        else if (ucspi) {
-                ircinfd = READ_FD;
-                ircoutfd = WRITE_FD;
-        } else
-		ircinfd = ircoutfd = tcpopen(host, service);
+	srand(time(NULL) ^ getpid()); /* reconnect jitter */
+
+	ev_init();
+	clock_update();
+	writer_start();
+	for (cn = conns; cn; cn = cn->next) {
+		if (cn->ucspi && cn != conns) {
+			/* there is only one pair of UCSPI descriptors */
+			fprintf(stderr, "%s: -t applies to the first server only\n",
+			        argv0);
+			exit(1);
+		}
+		if (!cn->username)
+			cn->username = cn->nick;
+		if (!cn->service)
+			cn->service = cn->tls ? "6697" : "6667";
+#ifndef USE_TLS
+		if (cn->tls) {
+			fprintf(stderr, "%s: built without TLS support\n", argv0);
+			exit(1);
+		}
+#endif
+		conn_init(cn);
+	}
 
 #ifdef __OpenBSD__
-	/* OpenBSD pledge(2) support */
-	if (pledge("stdio rpath wpath cpath dpath", NULL) == -1) {
+	/* OpenBSD pledge(2) support. the addrs file is refreshed by a resolver
+	 * thread, and reconnecting needs sockets of the kinds connected to */
+	strlcpy(promises, "stdio rpath wpath cpath dpath dns", sizeof(promises));
+	if (reconnmax) {
+		strlcat(promises, " inet", sizeof(promises));
+		for (cn = conns; cn; cn = cn->next) {
+			if (cn->uds) {
+				strlcat(promises, " unix", sizeof(promises));
+				break;
+			}
+		}
+	}
+	if (pledge(promises, NULL) == -1) {
 		fprintf(stderr, "%s: pledge: %s\n", argv0, strerror(errno));
 		exit(1);
 	}
 #endif
 
-	r = snprintf(ircpath, sizeof(ircpath), "%s/%s", prefix, host);
-	if (r < 0 || (size_t)r >= sizeof(ircpath)) {
-		fprintf(stderr, "%s: path to irc directory too long\n", argv0);
-		exit(1);
-	}
-	create_dirtree(ircpath);
-
-	channelmaster = channel_add(""); /* master channel */
-	if (key)
-		loginkey(ircoutfd, key);
-	loginuser(ircoutfd, host, username, fullname && *fullname ? fullname : username);
 	setup();
-	run(ircinfd, ircoutfd, host);
-	if (channelmaster)
-		channel_leave(channelmaster);
-
-	for (c = channels; c; c = tmp) {
-		tmp = c->next;
-		channel_leave(c);
-	}
+	run();
+	while (conns)
+		conn_free(conns, 1);
+	writer_stop();
 
-	return 0;
+	return exitstatus;
 }
@@ -0,0 +1,448 @@
+/* See LICENSE file for license details. */
+#define _XOPEN_SOURCE 700 /* nftw() */
+
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "arg.h"
+
+#define NCHANS      10   /* channels every scenario runs in */
+#define NAMES_LINE  40   /* nicks per 353 line */
+#define DONE_TOKEN  "iibench-done"
+
+typedef struct Buf Buf;
+struct Buf {
+	char *p;
+	size_t len, size;
+};
+
+typedef struct Scenario Scenario;
+struct Scenario {
+	const char *name;
+	void (*gen)(Buf *, long);
+};
+
+char *argv0;
+
+static void      bprintf(Buf *, const char *, ...);
+static void      die(const char *, ...);
+static void      gen_mixed(Buf *, long);
+static void      gen_mode(Buf *, long);
+static void      gen_names(Buf *, long);
+static void      gen_privmsg(Buf *, long);
+static void      gen_quit(Buf *, long);
+static void      join_all(Buf *);
+static long      lines(const Buf *);
+static double    now(void);
+static void      populate(Buf *, long);
+static int       procio(pid_t, unsigned long long *);
+static long      prochwm(pid_t);
+static int       rmentry(const char *, const struct stat *, int, struct FTW *);
+static void      run(const char *, const Scenario *, long);
+static void      usage(void);
+static void      waitfor(int, const char *);
+static void      writeall(int, const char *, size_t);
+
+static const Scenario scenarios[] = {
+	{ "privmsg", gen_privmsg }, /* PRIVMSG flood over all channels */
+	{ "names",   gen_names },   /* 353 bursts, as after joining */
+	{ "quit",    gen_quit },    /* netsplit: everyone quits */
+	{ "mode",    gen_mode },    /* op/voice storms */
+	{ "mixed",   gen_mixed },
+};
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: %s [-n lines] [-s scenario] <path to ii>\n",
+	        argv0);
+	exit(1);
+}
+
+static void
+die(const char *fmt, ...)
+{
+	va_list ap;
+
+	fprintf(stderr, "%s: ", argv0);
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	exit(1);
+}
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+bprintf(Buf *b, const char *fmt, ...)
+{
+	va_list ap;
+	int r;
+
+	for (;;) {
+		va_start(ap, fmt);
+		r = vsnprintf(b->p + b->len, b->size - b->len, fmt, ap);
+		va_end(ap);
+		if (r < 0)
+			die("vsnprintf: %s\n", strerror(errno));
+		if ((size_t)r < b->size - b->len)
+			break;
+		b->size = b->size ? b->size * 2 : 1 << 20;
+		if (!(b->p = realloc(b->p, b->size)))
+			die("realloc: %s\n", strerror(errno));
+	}
+	b->len += r;
+}
+
+static long
+lines(const Buf *b)
+{
+	const char *p;
+	long n = 0;
+
+	for (p = b->p; (p = memchr(p, '\n', b->p + b->len - p)); p++)
+		n++;
+	return n;
+}
+
+static void
+join_all(Buf *b)
+{
+	int i;
+
+	for (i = 0; i < NCHANS; i++)
+		bprintf(b, ":me!me@bench JOIN #bench%d\r\n", i);
+}
+
+/* n users, each in three of the channels, announced in 353 lines */
+static void
+populate(Buf *b, long n)
+{
+	long u, k;
+	int c;
+
+	for (c = 0; c < NCHANS; c++) {
+		for (u = c % 3, k = 0; u < n; u += 3, k++) {
+			if (k % NAMES_LINE == 0)
+				bprintf(b, "%s:irc.bench 353 me = #bench%d :",
+				        k ? "\r\n" : "", c);
+			bprintf(b, "%s%su%ld", k % NAMES_LINE ? " " : "",
+			        u % 10 == 0 ? "@" : u % 10 == 1 ? "+" : "", u);
+		}
+		if (k)
+			bprintf(b, "\r\n");
+		bprintf(b, ":irc.bench 366 me #bench%d :End of /NAMES list.\r\n", c);
+	}
+}
+
+static void
+gen_privmsg(Buf *b, long n)
+{
+	long i;
+
+	join_all(b);
+	populate(b, 1000);
+	for (i = 0; i < n; i++)
+		bprintf(b, ":u%ld!user%ld@host.bench PRIVMSG #bench%ld :message "
+		        "number %ld with some ordinary chat text in it\r\n",
+		        i % 1000, i % 1000, i % NCHANS, i);
+}
+
+static void
+gen_names(Buf *b, long n)
+{
+	long i;
+
+	/* the first burst adds 12000 users, the others resync them */
+	join_all(b);
+	for (i = 0; i < n / 1000 + 1; i++)
+		populate(b, 12000);
+}
+
+static void
+gen_quit(Buf *b, long n)
+{
+	long i;
+
+	join_all(b);
+	populate(b, n);
+	for (i = 0; i < n; i++)
+		bprintf(b, ":u%ld!user%ld@host.bench QUIT :irc.a.bench "
+		        "irc.b.bench\r\n", i, i);
+}
+
+static void
+gen_mode(Buf *b, long n)
+{
+	long i, u;
+
+	join_all(b);
+	populate(b, 3000);
+	for (i = 0; i < n; i++) {
+		u = (i * 7) % 3000;
+		bprintf(b, ":op!op@host.bench MODE #bench%ld %co+v-v u%ld u%ld "
+		        "u%ld\r\n", u % NCHANS, i & 1 ? '-' : '+',
+		        u, (u + 3) % 3000, (u + 6) % 3000);
+	}
+}
+
+static void
+gen_mixed(Buf *b, long n)
+{
+	long i, u;
+
+	join_all(b);
+	populate(b, n / 10);
+	for (i = 0; i < n; i++) {
+		u = i % (n / 10 + 1);
+		switch (i % 20) {
+		case 0:
+			bprintf(b, ":op!op@host.bench MODE #bench%ld +o u%ld\r\n",
+			        u % NCHANS, u);
+			break;
+		case 1:
+			bprintf(b, ":u%ld!user@host.bench NICK n%ld\r\n", u, i);
+			break;
+		case 2:
+			bprintf(b, ":j%ld!user@host.bench JOIN #bench%ld\r\n",
+			        i, i % NCHANS);
+			break;
+		case 3:
+			bprintf(b, ":j%ld!user@host.bench QUIT :bye\r\n", i - 1);
+			break;
+		case 4:
+			bprintf(b, ":irc.bench NOTICE me :server notice %ld\r\n", i);
+			break;
+		default:
+			bprintf(b, ":u%ld!user@host.bench PRIVMSG #bench%ld :hi "
+			        "there %ld\r\n", u, u % NCHANS, i);
+			break;
+		}
+	}
+}
+
+/* read and write calls done by pid so far, from /proc/<pid>/io. these are
+ * not all syscalls: poll, open, fsync and friends are not counted, and
+ * neither is I/O submitted through io_uring. */
+static int
+procio(pid_t pid, unsigned long long *calls)
+{
+	char path[64], key[32];
+	unsigned long long v;
+	FILE *fp;
+
+	snprintf(path, sizeof(path), "/proc/%ld/io", (long)pid);
+	if (!(fp = fopen(path, "r")))
+		return -1;
+	*calls = 0;
+	while (fscanf(fp, "%31s %llu", key, &v) == 2) {
+		if (!strcmp(key, "syscr:") || !strcmp(key, "syscw:"))
+			*calls += v;
+	}
+	fclose(fp);
+	return 0;
+}
+
+/* peak resident set size of pid in kB, -1 if unknown */
+static long
+prochwm(pid_t pid)
+{
+	char path[64], line[256];
+	long kb = -1;
+	FILE *fp;
+
+	snprintf(path, sizeof(path), "/proc/%ld/status", (long)pid);
+	if (!(fp = fopen(path, "r")))
+		return -1;
+	while (fgets(line, sizeof(line), fp)) {
+		if (!strncmp(line, "VmHWM:", 6)) {
+			kb = strtol(line + 6, NULL, 10);
+			break;
+		}
+	}
+	fclose(fp);
+	return kb;
+}
+
+static void
+writeall(int fd, const char *s, size_t len)
+{
+	ssize_t r;
+
+	while (len) {
+		if ((r = write(fd, s, len)) == -1) {
+			if (errno == EINTR)
+				continue;
+			die("write: %s\n", strerror(errno));
+		}
+		s += r;
+		len -= r;
+	}
+}
+
+/* read what ii sends to the server until s shows up */
+static void
+waitfor(int fd, const char *s)
+{
+	char buf[4096];
+	size_t len = 0;
+	ssize_t r;
+
+	for (;;) {
+		if ((r = read(fd, buf + len, sizeof(buf) - 1 - len)) <= 0) {
+			if (r == -1 && errno == EINTR)
+				continue;
+			die("ii went away before sending \"%s\"\n", s);
+		}
+		len += r;
+		buf[len] = '\0';
+		if (strstr(buf, s))
+			return;
+		if (len > sizeof(buf) / 2) { /* keep a tail to match across reads */
+			memmove(buf, buf + len - 64, 64);
+			len = 64;
+		}
+	}
+}
+
+static int
+rmentry(const char *path, const struct stat *st, int flag, struct FTW *ftw)
+{
+	(void)st;
+	(void)flag;
+	(void)ftw;
+	return remove(path);
+}
+
+static void
+run(const char *ii, const Scenario *sc, long n)
+{
+	Buf b = { NULL, 0, 0 };
+	struct rusage ru;
+	unsigned long long io0, io1;
+	char dir[] = "/tmp/iibench.XXXXXX";
+	int toii[2], fromii[2], in, out, haveio, status;
+	long nlines, hwm;
+	double t0, t1;
+	pid_t pid;
+
+	sc->gen(&b, n);
+	nlines = lines(&b);
+	bprintf(&b, "PING :%s\r\n", DONE_TOKEN);
+
+	if (!mkdtemp(dir))
+		die("mkdtemp: %s\n", strerror(errno));
+	if (pipe(toii) == -1 || pipe(fromii) == -1)
+		die("pipe: %s\n", strerror(errno));
+	fcntl(toii[1], F_SETFD, FD_CLOEXEC);
+	fcntl(fromii[0], F_SETFD, FD_CLOEXEC);
+
+	if ((pid = fork()) == -1)
+		die("fork: %s\n", strerror(errno));
+	if (pid == 0) {
+		/* ii -t reads the server from fd 6 and writes to fd 7 */
+		if ((in = fcntl(toii[0], F_DUPFD, 10)) == -1 ||
+		    (out = fcntl(fromii[1], F_DUPFD, 10)) == -1)
+			die("dup: %s\n", strerror(errno));
+		close(toii[0]);
+		close(fromii[1]);
+		if (dup2(in, 6) == -1 || dup2(out, 7) == -1)
+			die("dup2: %s\n", strerror(errno));
+		close(in);
+		close(out);
+		/* the raw server lines and ii's own reports */
+		if (!freopen("/dev/null", "w", stdout) ||
+		    !freopen("/dev/null", "w", stderr))
+			die("freopen: %s\n", strerror(errno));
+		execl(ii, ii, "-t", "-s", "bench", "-i", dir, "-n", "me",
+		      "-r", "0", (char *)NULL);
+		die("exec %s: %s\n", ii, strerror(errno));
+	}
+	close(toii[0]);
+	close(fromii[1]);
+
+	waitfor(fromii[0], "USER"); /* logged in, set up */
+	haveio = procio(pid, &io0) == 0;
+	t0 = now();
+	writeall(toii[1], b.p, b.len);
+	waitfor(fromii[0], "PONG " DONE_TOKEN);
+	t1 = now();
+	haveio = haveio && procio(pid, &io1) == 0;
+	hwm = prochwm(pid);
+
+	close(toii[1]); /* ii exits on end of file */
+	if (wait4(pid, &status, 0, &ru) == -1)
+		die("wait4: %s\n", strerror(errno));
+	close(fromii[0]);
+	if (hwm == -1)
+		hwm = ru.ru_maxrss;
+
+	printf("%-8s %8ld lines %7.3f s %10.0f lines/s", sc->name, nlines,
+	       t1 - t0, nlines / (t1 - t0));
+	if (haveio)
+		printf(" %6.3f rw calls/line", (double)(io1 - io0) / nlines);
+	else
+		printf("      - rw calls/line");
+	printf(" %7ld kB peak RSS\n", hwm);
+	fflush(stdout);
+
+	nftw(dir, rmentry, 16, FTW_DEPTH | FTW_PHYS);
+	free(b.p);
+}
+
+int
+main(int argc, char *argv[])
+{
+	const char *only = NULL;
+	long n = 100000;
+	size_t i;
+	int found = 0;
+
+	ARGBEGIN {
+	case 'n':
+		n = strtol(EARGF(usage()), NULL, 10);
+		break;
+	case 's':
+		only = EARGF(usage());
+		break;
+	default:
+		usage();
+		break;
+	} ARGEND;
+
+	if (argc != 1 || n < 1)
+		usage();
+	if (access(argv[0], X_OK) == -1)
+		die("%s: %s\n", argv[0], strerror(errno));
+
+	for (i = 0; i < sizeof(scenarios) / sizeof(scenarios[0]); i++) {
+		if (only && strcmp(only, scenarios[i].name))
+			continue;
+		run(argv[0], &scenarios[i], n);
+		found = 1;
+	}
+	if (!found)
+		die("unknown scenario: %s\n", only);
+
+	return 0;
+}
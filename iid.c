@@ -0,0 +1,849 @@
+/* See LICENSE file for license details.
+ *
+ * iid: a stand-in IRC server to put ii under load. it speaks just enough of
+ * the protocol for ii and simulates any number of users. the script, read
+ * from -f or stdin, has one command per line:
+ *
+ *   wait [n]               wait until n clients (default 1) are registered
+ *   users n                create users u0 .. u<n-1>
+ *   join chan              make every client join chan
+ *   enter chan n           join storm: users u0 .. u<n-1> join chan
+ *   names chan             send the 353 burst for chan again
+ *   flood chan n           n PRIVMSGs to chan, as fast as possible
+ *   say chan rate seconds  PRIVMSGs to chan at rate lines per second
+ *   mode chan n            n MODE lines giving and taking +o/+v
+ *   nick n                 n nick changes
+ *   split n                netsplit: n users quit
+ *   sync                   PING, wait for the PONG
+ *   latency chan n         time n lines from send until they are in the out
+ *                          file of chan; needs -o
+ *   sleep ms
+ *   reconnect [ms]         drop every client without a word and time until
+ *                          as many are registered again; fails after ms
+ *                          (default 30000)
+ *   quit                   disconnect every client
+ *
+ * lines starting with '#' are comments.
+ */
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/un.h>
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <netdb.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "arg.h"
+
+#define SERVER_NAME   "irc.iid"
+#define CLIENTS_MAX   32    /* real connections, one bit each in Chan */
+#define CHANS_MAX     256
+#define NICK_MAX      32
+#define IRC_BUF_MAX   8192
+#define OBUF_SIZE     65536
+#define NAMES_LINE    40    /* nicks per 353 line */
+#define LAT_TIMEOUT   5000  /* ms until a latency probe counts as lost */
+#define RECONN_TIMEOUT 30000 /* ms until the clients must be back */
+
+typedef struct Client Client;
+struct Client {
+	int fd;
+	char nick[NICK_MAX];
+	int hasnick, hasuser, registered;
+	char ibuf[IRC_BUF_MAX];
+	size_t ilen;
+	char obuf[OBUF_SIZE];
+	size_t olen;
+};
+
+/* a simulated user, only ever seen through the lines sent about it */
+typedef struct User User;
+struct User {
+	char nick[NICK_MAX];
+	int gone;              /* quit in a netsplit */
+};
+
+typedef struct Chan Chan;
+struct Chan {
+	char name[64];
+	unsigned long clients; /* bit i: clients[i] joined */
+	unsigned char *in;     /* in[u]: users[u] joined */
+	long nin;
+};
+
+char *argv0;
+
+static Client    clients[CLIENTS_MAX];
+static int       nclients = 0;
+static User     *users = NULL;
+static long      nusers = 0;
+static Chan      chans[CHANS_MAX];
+static int       nchans = 0;
+static int       lfd = -1;
+static const char *outdir = NULL;  /* ii's directory for this server (-o) */
+static char      pongwait[64];     /* token of an unanswered PING */
+static unsigned long seed = 1;
+
+static void      accept_client(void);
+static Chan *    chan_get(const char *);
+static void      chan_names(Chan *, Client *);
+static void      client_close(Client *);
+static void      client_join(Client *, const char *);
+static int       client_line(Client *, char *);
+static void      client_read(Client *);
+static void      csend(Client *, const char *, ...);
+static void      die(const char *, ...);
+static void      flush_all(void);
+static void      flush_client(Client *);
+static int       latency(const char *, long);
+static void      listen_tcp(const char *, const char *);
+static void      listen_uds(const char *);
+static long long now_us(void);
+static void      pump(int);
+static unsigned long rnd(void);
+static long      rnd_member(Chan *);
+static void      run_script(FILE *);
+static void      send_chan(Chan *, const Client *, const char *, ...);
+static void      send_all(const char *, ...);
+static void      usage(void);
+static void      users_grow(long);
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: %s [-l address] [-p port | -U sockname] "
+	        "[-o ii server dir] [-f script]\n", argv0);
+	exit(1);
+}
+
+static void
+die(const char *fmt, ...)
+{
+	va_list ap;
+
+	fprintf(stderr, "%s: ", argv0);
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	exit(1);
+}
+
+static long long
+now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+/* xorshift, so runs are repeatable */
+static unsigned long
+rnd(void)
+{
+	seed ^= seed << 13;
+	seed ^= seed >> 7;
+	seed ^= seed << 17;
+	return seed;
+}
+
+static void
+listen_tcp(const char *host, const char *port)
+{
+	struct addrinfo hints, *res, *rp;
+	int r, on = 1;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE;
+	if ((r = getaddrinfo(host, port, &hints, &res)) != 0)
+		die("getaddrinfo: %s\n", gai_strerror(r));
+	for (rp = res; rp; rp = rp->ai_next) {
+		if ((lfd = socket(rp->ai_family, rp->ai_socktype,
+		                  rp->ai_protocol)) == -1)
+			continue;
+		setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+		if (bind(lfd, rp->ai_addr, rp->ai_addrlen) == 0)
+			break;
+		close(lfd);
+		lfd = -1;
+	}
+	freeaddrinfo(res);
+	if (lfd == -1 || listen(lfd, 16) == -1)
+		die("cannot listen on %s port %s: %s\n", host, port,
+		    strerror(errno));
+}
+
+static void
+listen_uds(const char *path)
+{
+	struct sockaddr_un sun;
+
+	if (strlen(path) >= sizeof(sun.sun_path))
+		die("socket path too long\n");
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	strcpy(sun.sun_path, path);
+	unlink(path);
+	if ((lfd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1 ||
+	    bind(lfd, (struct sockaddr *)&sun, sizeof(sun)) == -1 ||
+	    listen(lfd, 16) == -1)
+		die("cannot listen on %s: %s\n", path, strerror(errno));
+}
+
+static void
+accept_client(void)
+{
+	Client *c;
+	int fd;
+
+	if ((fd = accept(lfd, NULL, NULL)) == -1)
+		return;
+	if (nclients == CLIENTS_MAX) {
+		close(fd);
+		return;
+	}
+	c = &clients[nclients++];
+	memset(c, 0, sizeof(*c));
+	c->fd = fd;
+	fprintf(stderr, "%s: client connected\n", argv0);
+}
+
+static void
+client_close(Client *c)
+{
+	int i = c - clients, j;
+
+	close(c->fd);
+	/* keep the channel bits in step with the compacted array */
+	for (j = 0; j < nchans; j++) {
+		unsigned long m = chans[j].clients, low = m & ((1UL << i) - 1);
+
+		chans[j].clients = low | ((m >> (i + 1)) << i);
+	}
+	memmove(c, c + 1, (clients + --nclients - c) * sizeof(*c));
+	fprintf(stderr, "%s: client disconnected\n", argv0);
+}
+
+static void
+flush_client(Client *c)
+{
+	size_t off = 0;
+	ssize_t r;
+
+	while (off < c->olen) {
+		if ((r = write(c->fd, c->obuf + off, c->olen - off)) == -1) {
+			if (errno == EINTR)
+				continue;
+			c->olen = 0; /* dropped on the next read */
+			return;
+		}
+		off += r;
+	}
+	c->olen = 0;
+}
+
+static void
+flush_all(void)
+{
+	int i;
+
+	for (i = 0; i < nclients; i++)
+		flush_client(&clients[i]);
+}
+
+static void
+csend(Client *c, const char *fmt, ...)
+{
+	char line[IRC_BUF_MAX];
+	va_list ap;
+	int r;
+
+	va_start(ap, fmt);
+	r = vsnprintf(line, sizeof(line) - 2, fmt, ap);
+	va_end(ap);
+	if (r < 0)
+		return;
+	if ((size_t)r > sizeof(line) - 3)
+		r = sizeof(line) - 3;
+	memcpy(line + r, "\r\n", 2);
+	r += 2;
+	if (c->olen + r > sizeof(c->obuf))
+		flush_client(c);
+	memcpy(c->obuf + c->olen, line, r);
+	c->olen += r;
+}
+
+/* a line to every client in ch except skip */
+static void
+send_chan(Chan *ch, const Client *skip, const char *fmt, ...)
+{
+	char line[IRC_BUF_MAX];
+	va_list ap;
+	int i;
+
+	va_start(ap, fmt);
+	vsnprintf(line, sizeof(line), fmt, ap);
+	va_end(ap);
+	for (i = 0; i < nclients; i++) {
+		if (&clients[i] != skip && (ch->clients & (1UL << i)))
+			csend(&clients[i], "%s", line);
+	}
+}
+
+static void
+send_all(const char *fmt, ...)
+{
+	char line[IRC_BUF_MAX];
+	va_list ap;
+	int i;
+
+	va_start(ap, fmt);
+	vsnprintf(line, sizeof(line), fmt, ap);
+	va_end(ap);
+	for (i = 0; i < nclients; i++) {
+		if (clients[i].registered)
+			csend(&clients[i], "%s", line);
+	}
+}
+
+static void
+users_grow(long n)
+{
+	long i;
+	int j;
+
+	if (n <= nusers)
+		return;
+	if (!(users = realloc(users, n * sizeof(*users))))
+		die("realloc: %s\n", strerror(errno));
+	for (i = nusers; i < n; i++) {
+		snprintf(users[i].nick, sizeof(users[i].nick), "u%ld", i);
+		users[i].gone = 0;
+	}
+	for (j = 0; j < nchans; j++) {
+		if (!(chans[j].in = realloc(chans[j].in, n)))
+			die("realloc: %s\n", strerror(errno));
+		memset(chans[j].in + nusers, 0, n - nusers);
+	}
+	nusers = n;
+}
+
+static Chan *
+chan_get(const char *name)
+{
+	Chan *ch;
+	int i;
+
+	for (i = 0; i < nchans; i++) {
+		if (!strcasecmp(chans[i].name, name))
+			return &chans[i];
+	}
+	if (nchans == CHANS_MAX)
+		die("too many channels\n");
+	ch = &chans[nchans++];
+	memset(ch, 0, sizeof(*ch));
+	snprintf(ch->name, sizeof(ch->name), "%s", name);
+	if (nusers && !(ch->in = calloc(nusers, 1)))
+		die("calloc: %s\n", strerror(errno));
+	return ch;
+}
+
+/* a random user in ch, -1 if there is none */
+static long
+rnd_member(Chan *ch)
+{
+	long u, i;
+
+	if (!ch->nin)
+		return -1;
+	for (i = 0; i < 64; i++) {
+		u = rnd() % nusers;
+		if (ch->in[u])
+			return u;
+	}
+	for (u = rnd() % nusers, i = 0; i < nusers; i++, u = (u + 1) % nusers) {
+		if (ch->in[u])
+			return u;
+	}
+	return -1;
+}
+
+/* 353 burst for ch and 366 */
+static void
+chan_names(Chan *ch, Client *c)
+{
+	char line[IRC_BUF_MAX];
+	size_t len = 0;
+	long u, k = 0;
+	int i;
+
+	for (i = 0; i < nclients; i++) {
+		if (ch->clients & (1UL << i))
+			len += snprintf(line + len, sizeof(line) - len, "%s%s",
+			                len ? " " : "", clients[i].nick);
+	}
+	for (u = 0; u < nusers; u++) {
+		if (!ch->in[u])
+			continue;
+		if (++k % NAMES_LINE == 0) {
+			csend(c, ":%s 353 %s = %s :%s", SERVER_NAME, c->nick,
+			      ch->name, line);
+			len = 0;
+		}
+		len += snprintf(line + len, sizeof(line) - len, "%s%s%s",
+		                len ? " " : "", u % 10 == 0 ? "@" :
+		                u % 10 == 1 ? "+" : "", users[u].nick);
+	}
+	if (len)
+		csend(c, ":%s 353 %s = %s :%s", SERVER_NAME, c->nick,
+		      ch->name, line);
+	csend(c, ":%s 366 %s %s :End of /NAMES list.", SERVER_NAME, c->nick,
+	      ch->name);
+}
+
+static void
+client_join(Client *c, const char *name)
+{
+	Chan *ch = chan_get(name);
+	int i = c - clients;
+
+	if (ch->clients & (1UL << i))
+		return;
+	ch->clients |= 1UL << i;
+	send_chan(ch, NULL, ":%s!%s@iid JOIN :%s", c->nick, c->nick, ch->name);
+	chan_names(ch, c);
+}
+
+/* handle a line from a client. returns -1 if the client was closed. */
+static int
+client_line(Client *c, char *line)
+{
+	char *cmd, *arg, *text, *rest, *p;
+	Chan *ch;
+	int i;
+
+	if ((text = strstr(line, " :")))
+		*text = '\0', text += 2;
+	cmd = strtok(line, " ");
+	arg = strtok(NULL, " ");
+	if (!cmd)
+		return 0;
+	for (p = cmd; *p; p++)
+		*p = toupper((unsigned char)*p);
+
+	if (!strcmp(cmd, "NICK")) {
+		if (!(arg = arg ? arg : text))
+			return 0;
+		if (c->registered)
+			send_all(":%s!%s@iid NICK :%s", c->nick, c->nick, arg);
+		snprintf(c->nick, sizeof(c->nick), "%s", arg);
+		c->hasnick = 1;
+	} else if (!strcmp(cmd, "USER")) {
+		c->hasuser = 1;
+	} else if (!strcmp(cmd, "PING")) {
+		csend(c, ":%s PONG %s :%s", SERVER_NAME, SERVER_NAME,
+		      arg ? arg : text ? text : "");
+	} else if (!strcmp(cmd, "PONG")) {
+		if ((arg = arg ? arg : text) && !strcmp(arg, pongwait))
+			pongwait[0] = '\0';
+	} else if (!strcmp(cmd, "JOIN") && (arg = arg ? arg : text)) {
+		for (p = strtok(arg, ","); p; p = strtok(NULL, ","))
+			client_join(c, p);
+	} else if (!strcmp(cmd, "PART") && arg) {
+		ch = chan_get(arg);
+		send_chan(ch, NULL, ":%s!%s@iid PART %s :%s", c->nick, c->nick,
+		          ch->name, text ? text : "");
+		ch->clients &= ~(1UL << (c - clients));
+	} else if ((!strcmp(cmd, "PRIVMSG") || !strcmp(cmd, "NOTICE")) && arg) {
+		if (arg[0] == '#' || arg[0] == '&') {
+			send_chan(chan_get(arg), c, ":%s!%s@iid %s %s :%s",
+			          c->nick, c->nick, cmd, arg, text ? text : "");
+			return 0;
+		}
+		for (i = 0; i < nclients; i++) {
+			if (!strcasecmp(clients[i].nick, arg))
+				csend(&clients[i], ":%s!%s@iid %s %s :%s", c->nick,
+				      c->nick, cmd, arg, text ? text : "");
+		}
+	} else if ((!strcmp(cmd, "MODE") || !strcmp(cmd, "TOPIC")) && arg &&
+	           (arg[0] == '#' || arg[0] == '&')) {
+		rest = strtok(NULL, "");
+		send_chan(chan_get(arg), NULL, ":%s!%s@iid %s %s %s%s%s",
+		          c->nick, c->nick, cmd, arg, rest ? rest : "",
+		          text ? " :" : "", text ? text : "");
+	} else if (!strcmp(cmd, "QUIT")) {
+		csend(c, "ERROR :Closing link (%s)", text ? text : "Quit");
+		flush_client(c);
+		client_close(c);
+		return -1;
+	}
+
+	if (!c->registered && c->hasnick && c->hasuser) {
+		c->registered = 1;
+		csend(c, ":%s 001 %s :Welcome to the iid test network %s",
+		      SERVER_NAME, c->nick, c->nick);
+		csend(c, ":%s 005 %s CHANTYPES=#& PREFIX=(ov)@+ "
+		      "CHANMODES=beI,k,l,imnst NETWORK=iid :are supported by "
+		      "this server", SERVER_NAME, c->nick);
+		csend(c, ":%s 376 %s :End of /MOTD command.", SERVER_NAME,
+		      c->nick);
+	}
+	return 0;
+}
+
+static void
+client_read(Client *c)
+{
+	char *p, *line;
+	ssize_t r;
+
+	if ((r = read(c->fd, c->ibuf + c->ilen, sizeof(c->ibuf) - c->ilen)) <= 0) {
+		if (r == -1 && errno == EINTR)
+			return;
+		client_close(c);
+		return;
+	}
+	c->ilen += r;
+	line = c->ibuf;
+	while ((p = memchr(line, '\n', c->ibuf + c->ilen - line))) {
+		*p = '\0';
+		if (p > line && p[-1] == '\r')
+			p[-1] = '\0';
+		if (client_line(c, line) == -1)
+			return;
+		line = p + 1;
+	}
+	c->ilen -= line - c->ibuf;
+	memmove(c->ibuf, line, c->ilen);
+	if (c->ilen == sizeof(c->ibuf))
+		c->ilen = 0; /* overlong line */
+}
+
+/* serve the clients for up to ms milliseconds, or just what is pending
+ * if ms is 0 */
+static void
+pump(int ms)
+{
+	struct pollfd pfd[CLIENTS_MAX + 1];
+	long long end = now_us() + ms * 1000LL, left;
+	int i, n, fds[CLIENTS_MAX];
+
+	do {
+		flush_all();
+		pfd[0].fd = lfd;
+		pfd[0].events = POLLIN;
+		for (i = 0; i < nclients; i++) {
+			pfd[i + 1].fd = fds[i] = clients[i].fd;
+			pfd[i + 1].events = POLLIN;
+		}
+		n = nclients;
+		left = end - now_us();
+		if (poll(pfd, n + 1, left > 0 ? (int)((left + 999) / 1000) : 0) == -1) {
+			if (errno == EINTR)
+				continue;
+			die("poll: %s\n", strerror(errno));
+		}
+		for (i = n - 1; i >= 0; i--) {
+			/* go backwards so closing one does not move the rest */
+			if (pfd[i + 1].revents && i < nclients &&
+			    clients[i].fd == fds[i])
+				client_read(&clients[i]);
+		}
+		if (pfd[0].revents & POLLIN)
+			accept_client();
+	} while (now_us() < end);
+	flush_all();
+}
+
+/* send probes to chan and time how long they take to show up in ii's out
+ * file. returns the number of probes that arrived. */
+static int
+latency(const char *chan, long n)
+{
+	char path[PATH_MAX], buf[8192], probe[64], *p;
+	long long *lat, t0, t1, sum = 0;
+	long i, j, got = 0;
+	size_t len = 0;
+	ssize_t r;
+	int fd = -1;
+
+	if (!outdir)
+		die("latency needs -o\n");
+	snprintf(path, sizeof(path), "%s/%s/out", outdir, chan);
+	for (p = path + strlen(outdir); *p; p++)
+		*p = tolower((unsigned char)*p);
+	if (!(lat = calloc(n, sizeof(*lat))))
+		die("calloc: %s\n", strerror(errno));
+	/* before the first probe: ii may write it before we get to look */
+	if ((fd = open(path, O_RDONLY)) != -1)
+		lseek(fd, 0, SEEK_END);
+
+	for (i = 0; i < n; i++) {
+		snprintf(probe, sizeof(probe), "iid-probe %ld ", i);
+		t0 = now_us();
+		send_all(":probe!probe@iid PRIVMSG %s :%s", chan, probe);
+		flush_all();
+		for (t1 = 0; !t1 && now_us() - t0 < LAT_TIMEOUT * 1000LL;) {
+			if (fd == -1 && (fd = open(path, O_RDONLY)) != -1)
+				lseek(fd, 0, SEEK_END);
+			if (fd != -1 && (r = read(fd, buf + len,
+			    sizeof(buf) - 1 - len)) > 0) {
+				len += r;
+				buf[len] = '\0';
+				if (strstr(buf, probe))
+					t1 = now_us();
+				if ((p = strrchr(buf, '\n'))) {
+					len = buf + len - p - 1;
+					memmove(buf, p + 1, len);
+				} else if (len == sizeof(buf) - 1) {
+					len = 0;
+				}
+				continue;
+			}
+			pump(0);
+		}
+		if (t1) {
+			lat[got++] = t1 - t0;
+			sum += t1 - t0;
+		}
+	}
+	if (fd != -1)
+		close(fd);
+
+	/* insertion sort, n is small */
+	for (i = 1; i < got; i++) {
+		for (t1 = lat[i], j = i; j > 0 && lat[j - 1] > t1; j--)
+			lat[j] = lat[j - 1];
+		lat[j] = t1;
+	}
+	if (got)
+		printf("latency %s: %ld/%ld probes, min %lld avg %lld p50 %lld "
+		       "p99 %lld max %lld us\n", chan, got, n, lat[0], sum / got,
+		       lat[got / 2], lat[got * 99 / 100], lat[got - 1]);
+	else
+		printf("latency %s: no probe arrived\n", chan);
+	free(lat);
+	return got;
+}
+
+static void
+run_script(FILE *fp)
+{
+	char line[1024], cmd[32], a1[64], a2[64], a3[64];
+	long long t0, t1, due;
+	long i, k, n, u, v, sent;
+	double rate;
+	Chan *ch;
+	int nargs, ci;
+
+	while (fgets(line, sizeof(line), fp)) {
+		a1[0] = a2[0] = a3[0] = '\0';
+		nargs = sscanf(line, "%31s %63s %63s %63s", cmd, a1, a2, a3);
+		if (nargs < 1 || cmd[0] == '#')
+			continue;
+		t0 = now_us();
+		sent = 0;
+
+		if (!strcmp(cmd, "wait")) {
+			/* n registered clients, default 1 */
+			n = nargs > 1 ? atol(a1) : 1;
+			for (;;) {
+				for (k = 0, ci = 0; ci < nclients; ci++)
+					k += clients[ci].registered;
+				if (k >= n)
+					break;
+				pump(100);
+			}
+		} else if (!strcmp(cmd, "users") && nargs > 1) {
+			users_grow(atol(a1));
+		} else if (!strcmp(cmd, "join") && nargs > 1) {
+			/* make every client join, as a server side JOIN */
+			for (ci = 0; ci < nclients; ci++)
+				client_join(&clients[ci], a1);
+		} else if (!strcmp(cmd, "enter") && nargs > 2) {
+			/* join storm: n users join chan */
+			ch = chan_get(a1);
+			users_grow(atol(a2));
+			for (u = 0, n = atol(a2); u < n; u++) {
+				if (ch->in[u] || users[u].gone)
+					continue;
+				ch->in[u] = 1;
+				ch->nin++;
+				send_chan(ch, NULL, ":%s!user@sim.iid JOIN :%s",
+				          users[u].nick, ch->name);
+				sent++;
+			}
+		} else if (!strcmp(cmd, "names") && nargs > 1) {
+			ch = chan_get(a1);
+			for (ci = 0; ci < nclients; ci++) {
+				if (ch->clients & (1UL << ci))
+					chan_names(ch, &clients[ci]);
+			}
+		} else if ((!strcmp(cmd, "flood") || !strcmp(cmd, "say")) &&
+		           nargs > 2) {
+			/* flood chan n, or say chan rate seconds */
+			ch = chan_get(a1);
+			rate = !strcmp(cmd, "say") ? atof(a2) : 0;
+			n = rate > 0 ? (long)(rate * atof(a3)) : atol(a2);
+			for (i = 0; i < n; i++) {
+				if (rate > 0) {
+					due = t0 + (long long)(i * 1e6 / rate);
+					if ((t1 = now_us()) < due)
+						pump((int)((due - t1) / 1000));
+				} else if (i % 256 == 0) {
+					pump(0);
+				}
+				if ((u = rnd_member(ch)) == -1)
+					break;
+				send_chan(ch, NULL, ":%s!user@sim.iid PRIVMSG %s "
+				          ":message %ld from %s", users[u].nick,
+				          ch->name, i, users[u].nick);
+				sent++;
+			}
+		} else if (!strcmp(cmd, "mode") && nargs > 2) {
+			ch = chan_get(a1);
+			for (i = 0, n = atol(a2); i < n; i++) {
+				if ((u = rnd_member(ch)) == -1 ||
+				    (v = rnd_member(ch)) == -1)
+					break;
+				send_chan(ch, NULL, ":op!op@sim.iid MODE %s %co+v "
+				          "%s %s", ch->name, i & 1 ? '-' : '+',
+				          users[u].nick, users[v].nick);
+				sent++;
+				if (i % 256 == 0)
+					pump(0);
+			}
+		} else if (!strcmp(cmd, "nick") && nargs > 1) {
+			for (i = 0, n = atol(a1); i < n && nusers; i++) {
+				u = rnd() % nusers;
+				if (users[u].gone)
+					continue;
+				send_all(":%s!user@sim.iid NICK :u%ldn%ld",
+				         users[u].nick, u, i);
+				snprintf(users[u].nick, sizeof(users[u].nick),
+				         "u%ldn%ld", u, i);
+				sent++;
+			}
+		} else if (!strcmp(cmd, "split") && nargs > 1) {
+			/* netsplit: n users quit */
+			for (u = 0, n = atol(a1); u < nusers && sent < n; u++) {
+				if (users[u].gone)
+					continue;
+				users[u].gone = 1;
+				for (ci = 0; ci < nchans; ci++) {
+					if (chans[ci].in[u]) {
+						chans[ci].in[u] = 0;
+						chans[ci].nin--;
+					}
+				}
+				send_all(":%s!user@sim.iid QUIT :%s irc.far.iid",
+				         users[u].nick, SERVER_NAME);
+				sent++;
+				if (sent % 256 == 0)
+					pump(0);
+			}
+		} else if (!strcmp(cmd, "sync")) {
+			/* everything sent so far has been read once PONG is back */
+			snprintf(pongwait, sizeof(pongwait), "sync%lld", t0);
+			send_all("PING :%s", pongwait);
+			while (pongwait[0] && nclients)
+				pump(100);
+		} else if (!strcmp(cmd, "latency") && nargs > 2) {
+			latency(a1, atol(a2));
+		} else if (!strcmp(cmd, "sleep") && nargs > 1) {
+			pump(atoi(a1));
+		} else if (!strcmp(cmd, "reconnect")) {
+			/* as if the server went away: no ERROR, just EOF */
+			n = nclients;
+			i = nargs > 1 ? atol(a1) : RECONN_TIMEOUT;
+			while (nclients)
+				client_close(&clients[0]);
+			for (;;) {
+				for (k = 0, ci = 0; ci < nclients; ci++)
+					k += clients[ci].registered;
+				if (k >= n)
+					break;
+				if (now_us() - t0 >= i * 1000LL)
+					die("reconnect: %ld of %ld clients back after "
+					    "%ld ms\n", k, n, i);
+				pump(100);
+			}
+			printf("reconnect: %ld clients back in %.3f s\n", n,
+			       (now_us() - t0) / 1e6);
+		} else if (!strcmp(cmd, "quit")) {
+			send_all("ERROR :Closing link (iid shutting down)");
+			flush_all();
+			while (nclients)
+				client_close(&clients[0]);
+		} else {
+			die("bad script line: %s", line);
+		}
+
+		pump(0);
+		t1 = now_us();
+		if (sent)
+			printf("%s %s: %ld lines in %.3f s (%.0f lines/s)\n", cmd,
+			       a1, sent, (t1 - t0) / 1e6,
+			       sent / ((t1 - t0) / 1e6 + 1e-9));
+		fflush(stdout);
+	}
+}
+
+int
+main(int argc, char *argv[])
+{
+	const char *host = "127.0.0.1", *port = "6667", *uds = NULL;
+	const char *script = NULL;
+	FILE *fp = stdin;
+
+	ARGBEGIN {
+	case 'f':
+		script = EARGF(usage());
+		break;
+	case 'l':
+		host = EARGF(usage());
+		break;
+	case 'o':
+		outdir = EARGF(usage());
+		break;
+	case 'p':
+		port = EARGF(usage());
+		break;
+	case 'U':
+		uds = EARGF(usage());
+		break;
+	default:
+		usage();
+		break;
+	} ARGEND;
+
+	signal(SIGPIPE, SIG_IGN);
+	if (uds)
+		listen_uds(uds);
+	else
+		listen_tcp(host, port);
+	if (script && !(fp = fopen(script, "r")))
+		die("%s: %s\n", script, strerror(errno));
+
+	run_script(fp);
+	/* keep serving the clients until they go away */
+	while (nclients)
+		pump(1000);
+	if (uds)
+		unlink(uds);
+
+	return 0;
+}
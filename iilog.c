@@ -0,0 +1,185 @@
+/* See LICENSE file for license details.
+ *
+ * iilog: print the lines of an ii "out" file written between two times.
+ * the out file and its out.idx are mmap(2)ed; the index is binary searched
+ * for the last entry before the start time, so only the lines from there on
+ * are read.
+ */
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "arg.h"
+
+/* an entry of "out.idx": the line at byte off of "out" and every line after
+ * it were written at or after sec. host byte order, as written by ii.c */
+typedef struct Idx Idx;
+struct Idx {
+	int64_t sec;
+	int64_t off;
+};
+
+char *argv0;
+
+static void      die(const char *, ...);
+static size_t    idx_seek(const char *, const char *, size_t, double);
+static double    line_time(const char *, const char *, double);
+static void     *map(const char *, size_t *);
+static void      usage(void);
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: %s [-f from] [-t to] <out file>\n", argv0);
+	exit(1);
+}
+
+static void
+die(const char *fmt, ...)
+{
+	va_list ap;
+
+	fprintf(stderr, "%s: ", argv0);
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	exit(1);
+}
+
+/* map path read-only. NULL with errno == 0 for an empty file */
+static void *
+map(const char *path, size_t *len)
+{
+	struct stat st;
+	void *p;
+	int fd;
+
+	*len = 0;
+	if ((fd = open(path, O_RDONLY)) == -1)
+		return NULL;
+	if (fstat(fd, &st) == -1) {
+		close(fd);
+		return NULL;
+	}
+	if (st.st_size == 0) {
+		close(fd);
+		errno = 0;
+		return NULL;
+	}
+	p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED)
+		return NULL;
+	*len = st.st_size;
+	return p;
+}
+
+/* the timestamp a line starts with, "<seconds>[.<fraction>]", or prev for
+ * a line without one */
+static double
+line_time(const char *p, const char *end, double prev)
+{
+	char buf[32];
+	size_t i;
+
+	for (i = 0; i < sizeof(buf) - 1 && p + i < end &&
+	     ((p[i] >= '0' && p[i] <= '9') || p[i] == '.'); i++)
+		buf[i] = p[i];
+	if (!i)
+		return prev;
+	buf[i] = '\0';
+	return strtod(buf, NULL);
+}
+
+/* offset in out to start reading at for lines at or after from: that of
+ * the last index entry before from, 0 without a (usable) index */
+static size_t
+idx_seek(const char *idxpath, const char *out, size_t outlen, double from)
+{
+	const Idx *idx;
+	size_t len, lo, hi, mid, off = 0;
+	int64_t sec = from; /* entries have whole seconds, lines may not */
+
+	if (!(idx = map(idxpath, &len)))
+		return 0;
+	/* entries are in time order: find the first one in or after the
+	 * second of from */
+	lo = 0;
+	hi = len / sizeof(Idx);
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (idx[mid].sec < sec)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo > 0)
+		off = idx[lo - 1].off;
+	munmap((void *)idx, len);
+
+	/* a stale index (out was replaced) must not put us mid-line */
+	if (off > outlen || (off > 0 && out[off - 1] != '\n'))
+		return 0;
+	return off;
+}
+
+int
+main(int argc, char *argv[])
+{
+	char idxpath[PATH_MAX];
+	const char *out, *p, *end, *nl, *start;
+	double from = 0, to = -1, t = 0;
+	size_t len;
+
+	ARGBEGIN {
+	case 'f':
+		from = strtod(EARGF(usage()), NULL);
+		break;
+	case 't':
+		to = strtod(EARGF(usage()), NULL);
+		break;
+	default:
+		usage();
+		break;
+	} ARGEND;
+
+	if (argc != 1)
+		usage();
+	if (snprintf(idxpath, sizeof(idxpath), "%s.idx", argv[0]) >= (int)sizeof(idxpath))
+		die("%s: %s\n", argv[0], strerror(ENAMETOOLONG));
+	if (!(out = map(argv[0], &len))) {
+		if (errno)
+			die("%s: %s\n", argv[0], strerror(errno));
+		return 0;
+	}
+	end = out + len;
+
+	/* skip what is before from, then print up to the first line after to
+	 * in one go */
+	for (p = out + idx_seek(idxpath, out, len, from); p < end; p = nl) {
+		nl = memchr(p, '\n', end - p);
+		nl = nl ? nl + 1 : end;
+		if ((t = line_time(p, nl, t)) >= from)
+			break;
+	}
+	for (start = p; p < end; p = nl) {
+		if (to >= 0 && (t = line_time(p, end, t)) > to)
+			break;
+		nl = memchr(p, '\n', end - p);
+		nl = nl ? nl + 1 : end;
+	}
+	if (fwrite(start, 1, p - start, stdout) != (size_t)(p - start) ||
+	    fflush(stdout) == EOF)
+		die("write: %s\n", strerror(errno));
+	return 0;
+}